@@ -0,0 +1,199 @@
+#include <assert.h>
+#include <string.h>
+
+#ifdef DO_MEMDEBUG
+#include <mncommon/memdebug.h>
+MEMDEBUG_DECLARE(mnamqp_confirm);
+#endif
+
+#include <mncommon/dumpm.h>
+#include <mncommon/util.h>
+
+#include <mnamqp_private.h>
+
+#include "diag.h"
+
+/*
+ * Publisher confirm tracking.
+ *
+ * Publish tags are assigned sequentially starting from 1, so unconfirmed
+ * publishes live in a ring of slots indexed by tag.  base is the oldest
+ * unconfirmed tag: single acks mark their slot and move base over settled
+ * slots, multiple acks settle from base up to the tag.  Every tag is
+ * visited a bounded number of times, O(1) amortized per confirm.
+ */
+
+#define AMQP_CONFIRM_TRACKER_SZ 64
+
+#define SLOT(tr, tag) (&(tr)->slots[(tag) & ((tr)->sz - 1)])
+
+
+void
+amqp_confirm_tracker_init(amqp_confirm_tracker_t *tr)
+{
+    tr->sz = AMQP_CONFIRM_TRACKER_SZ;
+    if ((tr->slots = malloc(sizeof(amqp_confirm_slot_t) * tr->sz)) == NULL) {
+        FAIL("malloc");
+    }
+    memset(tr->slots, 0, sizeof(amqp_confirm_slot_t) * tr->sz);
+    tr->base = 1;
+    tr->next = 1;
+    tr->npending = 0;
+}
+
+
+void
+amqp_confirm_tracker_fini(amqp_confirm_tracker_t *tr)
+{
+    if (tr->slots != NULL) {
+        free(tr->slots);
+        tr->slots = NULL;
+    }
+    tr->sz = 0;
+    tr->npending = 0;
+}
+
+
+static void
+tracker_grow(amqp_confirm_tracker_t *tr)
+{
+    amqp_confirm_slot_t *slots;
+    size_t sz;
+    uint64_t tag;
+
+    sz = tr->sz * 2;
+    if ((slots = malloc(sizeof(amqp_confirm_slot_t) * sz)) == NULL) {
+        FAIL("malloc");
+    }
+    memset(slots, 0, sizeof(amqp_confirm_slot_t) * sz);
+    for (tag = tr->base; tag < tr->next; ++tag) {
+        slots[tag & (sz - 1)] = *SLOT(tr, tag);
+    }
+    free(tr->slots);
+    tr->slots = slots;
+    tr->sz = sz;
+}
+
+
+static void
+tracker_advance(amqp_confirm_tracker_t *tr)
+{
+    while (tr->base < tr->next && !SLOT(tr, tr->base)->pending) {
+        ++tr->base;
+    }
+}
+
+
+/*
+ * Register the next publish, return its tag.
+ */
+uint64_t
+amqp_confirm_tracker_add(amqp_confirm_tracker_t *tr,
+                         amqp_pending_pub_t *pp,
+                         uint64_t ts)
+{
+    uint64_t tag;
+    amqp_confirm_slot_t *slot;
+
+    if ((tr->next - tr->base) >= tr->sz) {
+        tracker_grow(tr);
+    }
+    tag = tr->next++;
+    slot = SLOT(tr, tag);
+    slot->pp = pp;
+    slot->ts = ts;
+    slot->pending = 1;
+    ++tr->npending;
+    return tag;
+}
+
+
+/*
+ * Detach a waiting publisher that gave up, the tag stays unconfirmed.
+ */
+void
+amqp_confirm_tracker_forget(amqp_confirm_tracker_t *tr, uint64_t tag)
+{
+    if (tag >= tr->base && tag < tr->next) {
+        SLOT(tr, tag)->pp = NULL;
+    }
+}
+
+
+static void
+tracker_settle_one(amqp_confirm_tracker_t *tr,
+                   uint64_t tag,
+                   int status,
+                   amqp_confirm_settle_cb_t cb,
+                   void *udata)
+{
+    amqp_confirm_slot_t *slot, s;
+
+    slot = SLOT(tr, tag);
+    s = *slot;
+    slot->pp = NULL;
+    slot->pending = 0;
+    --tr->npending;
+    /* cb may add more tags and grow the ring, so do it last */
+    if (cb != NULL) {
+        cb(&s, tag, status, udata);
+    }
+}
+
+
+/*
+ * Settle the tag, or every unconfirmed tag up to and including it if
+ * multiple.  Return the number of publishes settled.
+ */
+size_t
+amqp_confirm_tracker_settle(amqp_confirm_tracker_t *tr,
+                            uint64_t tag,
+                            int multiple,
+                            int status,
+                            amqp_confirm_settle_cb_t cb,
+                            void *udata)
+{
+    size_t res;
+
+    res = 0;
+    if (tag >= tr->next) {
+        return res;
+    }
+
+    if (multiple) {
+        while (tr->base <= tag) {
+            uint64_t t;
+
+            t = tr->base++;
+            if (SLOT(tr, t)->pending) {
+                tracker_settle_one(tr, t, status, cb, udata);
+                ++res;
+            }
+        }
+        tracker_advance(tr);
+
+    } else if (tag >= tr->base && SLOT(tr, tag)->pending) {
+        tracker_settle_one(tr, tag, status, cb, udata);
+        ++res;
+        tracker_advance(tr);
+    }
+
+    return res;
+}
+
+
+/*
+ * The slot of the oldest unconfirmed publish, NULL if none.
+ */
+amqp_confirm_slot_t *
+amqp_confirm_tracker_oldest(amqp_confirm_tracker_t *tr, uint64_t *tag)
+{
+    if (tr->base < tr->next) {
+        assert(SLOT(tr, tr->base)->pending);
+        if (tag != NULL) {
+            *tag = tr->base;
+        }
+        return SLOT(tr, tr->base);
+    }
+    return NULL;
+}
@@ -0,0 +1,207 @@
+#include <assert.h>
+#include <string.h>
+
+#ifdef DO_MEMDEBUG
+#include <mncommon/memdebug.h>
+MEMDEBUG_DECLARE(mnamqp_delivery);
+#endif
+
+#include <mncommon/dumpm.h>
+#include <mncommon/util.h>
+
+#include <mnamqp_private.h>
+
+#include "diag.h"
+
+/*
+ * Consumer acknowledgement tracking.
+ *
+ * The broker numbers deliveries on a channel sequentially, so their state
+ * lives in a ring indexed by delivery tag.  base is the oldest delivery
+ * that may still need a basic.ack or basic.nack sent.  Completions may
+ * come in any order: acked deliveries wait in the ring until every
+ * delivery before them is settled, then the whole run goes out as a
+ * single multiple basic.ack.  A multiple ack never covers an unsettled
+ * delivery.
+ */
+
+#define AMQP_DELIVERY_TRACKER_SZ 256
+
+#define STATE(tr, tag) ((tr)->state[(tag) & ((tr)->sz - 1)])
+
+
+void
+amqp_delivery_tracker_init(amqp_delivery_tracker_t *tr)
+{
+    tr->sz = AMQP_DELIVERY_TRACKER_SZ;
+    if ((tr->state = malloc(tr->sz)) == NULL) {
+        FAIL("malloc");
+    }
+    memset(tr->state, 0, tr->sz);
+    tr->base = 1;
+    tr->next = 1;
+    tr->nready = 0;
+    tr->ready_since = 0;
+}
+
+
+void
+amqp_delivery_tracker_fini(amqp_delivery_tracker_t *tr)
+{
+    if (tr->state != NULL) {
+        free(tr->state);
+        tr->state = NULL;
+    }
+    tr->sz = 0;
+    tr->nready = 0;
+}
+
+
+static void
+tracker_grow(amqp_delivery_tracker_t *tr, uint64_t tag)
+{
+    uint8_t *state;
+    size_t sz;
+    uint64_t t;
+
+    sz = tr->sz;
+    while ((tag - tr->base) >= sz) {
+        sz *= 2;
+    }
+    if ((state = malloc(sz)) == NULL) {
+        FAIL("malloc");
+    }
+    memset(state, 0, sz);
+    for (t = tr->base; t < tr->next; ++t) {
+        state[t & (sz - 1)] = STATE(tr, t);
+    }
+    free(tr->state);
+    tr->state = state;
+    tr->sz = sz;
+}
+
+
+/*
+ * Register a delivery.  Deliveries to no-ack consumers are registered
+ * settled, they only move the tag sequence.
+ */
+void
+amqp_delivery_tracker_add(amqp_delivery_tracker_t *tr,
+                          uint64_t tag,
+                          int settled)
+{
+    if (tag < tr->next) {
+        CTRACE("delivery_tag=%ld is behind %ld, ignoring", tag, tr->next);
+        return;
+    }
+    if ((tag - tr->base) >= tr->sz) {
+        tracker_grow(tr, tag);
+    }
+    /* tags skipped by the broker count as settled */
+    while (tr->next < tag) {
+        STATE(tr, tr->next++) = 0;
+    }
+    STATE(tr, tag) = settled ? 0 : AMQP_DELIVERY_UNSETTLED;
+    tr->next = tag + 1;
+    /*
+     * nothing is ever sent for settled deliveries at base, on a no-ack
+     * channel base would otherwise never move and the ring never stop
+     * growing
+     */
+    while (tr->base < tr->next && STATE(tr, tr->base) == 0) {
+        ++tr->base;
+    }
+}
+
+
+int
+amqp_delivery_tracker_unsettled(amqp_delivery_tracker_t *tr, uint64_t tag)
+{
+    return tag >= tr->base &&
+           tag < tr->next &&
+           STATE(tr, tag) == AMQP_DELIVERY_UNSETTLED;
+}
+
+
+/*
+ * Mark an unsettled delivery acked, its basic.ack is sent by
+ * amqp_delivery_tracker_collect().
+ */
+int
+amqp_delivery_tracker_ack(amqp_delivery_tracker_t *tr,
+                          uint64_t tag,
+                          uint64_t now)
+{
+    if (!amqp_delivery_tracker_unsettled(tr, tag)) {
+        return 1;
+    }
+    STATE(tr, tag) = AMQP_DELIVERY_ACKED;
+    if (tr->nready++ == 0) {
+        tr->ready_since = now;
+    }
+    return 0;
+}
+
+
+/*
+ * Mark an unsettled delivery settled by a basic.nack or basic.reject
+ * already sent.
+ */
+int
+amqp_delivery_tracker_settle(amqp_delivery_tracker_t *tr, uint64_t tag)
+{
+    if (!amqp_delivery_tracker_unsettled(tr, tag)) {
+        return 1;
+    }
+    STATE(tr, tag) = 0;
+    return 0;
+}
+
+
+/*
+ * Pass acks due to cb(tag, n, udata): the run of settled deliveries from
+ * base as one ack covering n acked deliveries up to tag, and if flush, the
+ * acked deliveries past the first unsettled one each on its own.  Return
+ * the number of acks passed.
+ */
+size_t
+amqp_delivery_tracker_collect(amqp_delivery_tracker_t *tr,
+                              int flush,
+                              amqp_delivery_ack_cb_t cb,
+                              void *udata)
+{
+    size_t res, n;
+    uint64_t last, tag;
+
+    res = 0;
+    n = 0;
+    last = 0;
+    while (tr->base < tr->next &&
+           STATE(tr, tr->base) != AMQP_DELIVERY_UNSETTLED) {
+        if (STATE(tr, tr->base) == AMQP_DELIVERY_ACKED) {
+            STATE(tr, tr->base) = 0;
+            last = tr->base;
+            ++n;
+        }
+        ++tr->base;
+    }
+    if (n > 0) {
+        assert(tr->nready >= n);
+        tr->nready -= n;
+        cb(last, n, udata);
+        ++res;
+    }
+
+    if (flush) {
+        for (tag = tr->base; tr->nready > 0 && tag < tr->next; ++tag) {
+            if (STATE(tr, tag) == AMQP_DELIVERY_ACKED) {
+                STATE(tr, tag) = 0;
+                --tr->nready;
+                cb(tag, 1, udata);
+                ++res;
+            }
+        }
+    }
+
+    return res;
+}
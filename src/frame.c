@@ -1,3 +1,5 @@
+#include <assert.h>
+
 #ifdef DO_MEMDEBUG
 #include <mncommon/memdebug.h>
 MEMDEBUG_DECLARE(mnamqp_frame);
@@ -16,9 +18,7 @@ amqp_frame_new(uint16_t chan, uint8_t type)
 {
     amqp_frame_t *res;
 
-    if ((res = malloc(sizeof(amqp_frame_t))) == NULL) {
-        FAIL("malloc");
-    }
+    res = amqp_pool_get(&amqp_frame_pool);
     res->payload.params = NULL;
     STQUEUE_ENTRY_INIT(link, res);
     res->sz = 0;
@@ -37,10 +37,14 @@ amqp_frame_dump(amqp_frame_t *fr)
             amqp_meth_params_dump(fr->payload.params);
         } else if (fr->type == AMQP_FHEADER) {
             amqp_header_dump(fr->payload.header);
-        } else if (fr->type == AMQP_FBODY) {
+        } else if (fr->type == AMQP_FBODY ||
+                   fr->type == AMQP_FBODYREF ||
+                   fr->type == AMQP_FBODYV) {
             TRACEC("sz=%d", fr->sz);
             //TRACEC("\n");
             //D8(fr->payload.body, fr->sz);
+        } else if (fr->type == AMQP_FHEADERRAW) {
+            TRACEC("body_size=%ld", (long)fr->payload.raw.body_size);
         }
     }
     TRACEC("]");
@@ -52,7 +56,7 @@ amqp_frame_destroy_method(amqp_frame_t **fr)
 {
     if (*fr != NULL) {
         amqp_meth_params_destroy(&(*fr)->payload.params);
-        free(*fr);
+        amqp_pool_put(&amqp_frame_pool, *fr);
         *fr = NULL;
     }
 }
@@ -63,7 +67,7 @@ amqp_frame_destroy_header(amqp_frame_t **fr)
 {
     if (*fr != NULL) {
         amqp_header_destroy(&(*fr)->payload.header);
-        free(*fr);
+        amqp_pool_put(&amqp_frame_pool, *fr);
         *fr = NULL;
     }
 }
@@ -74,9 +78,9 @@ amqp_frame_destroy_body(amqp_conn_t *conn, amqp_frame_t **fr)
 {
     if (*fr != NULL) {
         if ((*fr)->payload.body != NULL) {
-            conn->buffer_free((*fr)->payload.body);
+            amqp_conn_obuffer_free(conn, (*fr)->payload.body, (*fr)->sz);
         }
-        free(*fr);
+        amqp_pool_put(&amqp_frame_pool, *fr);
         *fr = NULL;
     }
 }
@@ -97,15 +101,216 @@ amqp_frame_destroy(amqp_conn_t *conn, amqp_frame_t **fr)
 
         case AMQP_FBODY:
             if ((*fr)->payload.body != NULL) {
-                conn->buffer_free((*fr)->payload.body);
+                amqp_conn_obuffer_free(conn, (*fr)->payload.body, (*fr)->sz);
             }
             break;
 
         case AMQP_FBODYEX:
             break;
+
+        case AMQP_FBODYREF:
+            amqp_body_ref_decref(&(*fr)->payload.bodyref.ref);
+            break;
+
+        case AMQP_FMETHODRAW:
+            amqp_publish_template_decref(&(*fr)->payload.raw.tpl);
+            break;
+
+        case AMQP_FHEADERRAW:
+            if ((*fr)->payload.raw.props != NULL) {
+                amqp_conn_obuffer_free(conn,
+                                      (*fr)->payload.raw.props,
+                                      (*fr)->payload.raw.props_sz);
+            }
+            amqp_publish_template_decref(&(*fr)->payload.raw.tpl);
+            amqp_message_release(&(*fr)->payload.raw.msg);
+            break;
+
+        case AMQP_FBODYV:
+            amqp_body_ref_decref(&(*fr)->payload.bodyv.ref);
+            break;
         }
 
-        free(*fr);
+        amqp_pool_put(&amqp_frame_pool, *fr);
         *fr = NULL;
     }
 }
+
+
+/*
+ * body references
+ */
+amqp_body_ref_t *
+amqp_body_ref_new(void (*release)(void *), void *udata)
+{
+    amqp_body_ref_t *res;
+
+    if ((res = malloc(sizeof(amqp_body_ref_t))) == NULL) {
+        FAIL("malloc");
+    }
+    res->nref = 1;
+    res->release = release;
+    res->udata = udata;
+    res->iov = NULL;
+    return res;
+}
+
+
+void
+amqp_body_ref_incref(amqp_body_ref_t *ref)
+{
+    ++ref->nref;
+}
+
+
+void
+amqp_body_ref_decref(amqp_body_ref_t **ref)
+{
+    if (*ref != NULL) {
+        assert((*ref)->nref > 0);
+        if (--(*ref)->nref == 0) {
+            if ((*ref)->release != NULL) {
+                (*ref)->release((*ref)->udata);
+            }
+            if ((*ref)->iov != NULL) {
+                free((*ref)->iov);
+            }
+            free(*ref);
+        }
+        *ref = NULL;
+    }
+}
+
+
+/*
+ * publish templates
+ */
+amqp_publish_template_t *
+amqp_publish_template_new(const char *exchange,
+                          const char *routing_key,
+                          uint8_t flags,
+                          amqp_header_t *header)
+{
+    amqp_publish_template_t *res;
+    mnbytes_t *s;
+
+    assert(exchange != NULL);
+    assert(routing_key != NULL);
+
+    if ((res = malloc(sizeof(amqp_publish_template_t))) == NULL) {
+        FAIL("malloc");
+    }
+    res->nref = 1;
+
+    /* basic.publish as amqp_basic_publish_enc() would put it */
+    bytestream_init(&res->method, 256);
+    pack_short(&res->method, AMQP_BASIC);
+    pack_short(&res->method, AMQP_BASIC_PUBLISH & 0xffff);
+    pack_short(&res->method, 0);
+    s = bytes_new_from_str(exchange);
+    pack_shortstr(&res->method, s);
+    BYTES_DECREF(&s);
+    s = bytes_new_from_str(routing_key);
+    pack_shortstr(&res->method, s);
+    BYTES_DECREF(&s);
+    pack_octet(&res->method, flags);
+
+    /* header properties, only body_size varies per message */
+    bytestream_init(&res->props, 256);
+    if (header != NULL) {
+        amqp_header_enc_props(header, &res->props);
+    } else {
+        pack_short(&res->props, 0);
+    }
+
+    return res;
+}
+
+
+void
+amqp_publish_template_incref(amqp_publish_template_t *tpl)
+{
+    ++tpl->nref;
+}
+
+
+void
+amqp_publish_template_decref(amqp_publish_template_t **tpl)
+{
+    if (*tpl != NULL) {
+        assert((*tpl)->nref > 0);
+        if (--(*tpl)->nref == 0) {
+            bytestream_fini(&(*tpl)->method);
+            bytestream_fini(&(*tpl)->props);
+            free(*tpl);
+        }
+        *tpl = NULL;
+    }
+}
+
+
+/*
+ * messages
+ */
+amqp_message_t *
+amqp_message_new(amqp_frame_t *method,
+                 amqp_frame_t *header,
+                 char *data,
+                 void (*buffer_free)(void *))
+{
+    amqp_message_t *res;
+
+    if ((res = malloc(sizeof(amqp_message_t))) == NULL) {
+        FAIL("malloc");
+    }
+    res->method = method;
+    res->header = header;
+    res->data = data;
+    res->buffer_free = buffer_free;
+    res->props = NULL;
+    res->nref = 1;
+    return res;
+}
+
+
+amqp_message_t *
+amqp_message_retain(amqp_message_t *msg)
+{
+    ++msg->nref;
+    return msg;
+}
+
+
+/*
+ * Drop a reference, the last one frees the frames and the body.
+ */
+void
+amqp_message_release(amqp_message_t **msg)
+{
+    if (*msg != NULL) {
+        assert((*msg)->nref > 0);
+        if (--(*msg)->nref == 0) {
+            amqp_frame_destroy_method(&(*msg)->method);
+            amqp_frame_destroy_header(&(*msg)->header);
+            if ((*msg)->data != NULL) {
+                (*msg)->buffer_free((*msg)->data);
+            }
+            if ((*msg)->props != NULL) {
+                bytestream_fini((*msg)->props);
+                free((*msg)->props);
+            }
+            free(*msg);
+        }
+        *msg = NULL;
+    }
+}
+
+
+/*
+ * frames still queued keep the template alive until they are written out
+ */
+void
+amqp_publish_template_destroy(amqp_publish_template_t **tpl)
+{
+    amqp_publish_template_decref(tpl);
+}
@@ -0,0 +1,188 @@
+#include <assert.h>
+
+#ifdef DO_MEMDEBUG
+#include <mncommon/memdebug.h>
+MEMDEBUG_DECLARE(mnamqp_memory);
+#endif
+
+#include <mncommon/dumpm.h>
+#include <mncommon/util.h>
+
+#include <mnamqp_private.h>
+
+#include "diag.h"
+
+/*
+ * Body buffer accounting.
+ *
+ * Body buffers of all connections are allocated through
+ * amqp_conn_buffer_alloc(): publish copies until the send thread has
+ * written them out, and deliveries from their content header until they
+ * are passed over to the application.  Above the cap, the receiving
+ * threads stop reading at the next delivery boundary, and publishes wait
+ * in channel_publish_wait() for the send threads to write out the
+ * outbound buffers, allocated through amqp_conn_obuffer_alloc().  They do
+ * not wait for deliveries to be freed: a handler republishing would wait
+ * for itself.  A delivery under way is received in full, so a connection
+ * may overshoot the cap by one body, and publishes may overshoot it while
+ * deliveries alone are over it.  The library runs in a single OS thread
+ * under mnthr, so the counters need no locking.
+ */
+
+static size_t memory_cap = 0;
+static size_t memory_live = 0;
+static size_t memory_peak = 0;
+/* the part of memory_live the send threads are to free */
+static size_t memory_out = 0;
+static mnthr_cond_t memory_room;
+
+
+void
+amqp_memory_init(void)
+{
+    mnthr_cond_init(&memory_room);
+}
+
+
+void
+amqp_memory_fini(void)
+{
+    mnthr_cond_fini(&memory_room);
+}
+
+
+static void
+memory_add(amqp_conn_t *conn, size_t sz)
+{
+    memory_live += sz;
+    memory_peak = MAX(memory_peak, memory_live);
+    conn->stats.mem_live += sz;
+    conn->stats.mem_peak = MAX(conn->stats.mem_peak, conn->stats.mem_live);
+}
+
+
+void *
+amqp_conn_buffer_alloc(amqp_conn_t *conn, size_t sz)
+{
+    void *buf;
+
+    if (conn->slab != NULL) {
+        buf = amqp_slab_alloc(conn->slab, sz);
+    } else {
+        buf = conn->buffer_alloc(sz);
+    }
+    if (buf != NULL) {
+        memory_add(conn, sz);
+    }
+    return buf;
+}
+
+
+/*
+ * sz octets no longer held by the library
+ */
+void
+amqp_conn_buffer_passed(amqp_conn_t *conn, size_t sz)
+{
+    assert(memory_live >= sz);
+    assert(conn->stats.mem_live >= sz);
+    memory_live -= sz;
+    conn->stats.mem_live -= sz;
+    if (memory_cap > 0 && memory_live < memory_cap) {
+        mnthr_cond_signal_all(&memory_room);
+    }
+}
+
+
+void
+amqp_conn_buffer_free(amqp_conn_t *conn, void *buf, size_t sz)
+{
+    if (conn->slab != NULL) {
+        amqp_slab_free(conn->slab, buf, sz);
+    } else {
+        conn->buffer_free(buf);
+    }
+    amqp_conn_buffer_passed(conn, sz);
+}
+
+
+/*
+ * buffers of frames to send
+ */
+void *
+amqp_conn_obuffer_alloc(amqp_conn_t *conn, size_t sz)
+{
+    void *buf;
+
+    if ((buf = amqp_conn_buffer_alloc(conn, sz)) != NULL) {
+        memory_out += sz;
+    }
+    return buf;
+}
+
+
+void
+amqp_conn_obuffer_free(amqp_conn_t *conn, void *buf, size_t sz)
+{
+    assert(memory_out >= sz);
+    memory_out -= sz;
+    if (memory_cap > 0 && memory_out == 0) {
+        mnthr_cond_signal_all(&memory_room);
+    }
+    amqp_conn_buffer_free(conn, buf, sz);
+}
+
+
+int
+amqp_memory_over_cap(void)
+{
+    return memory_cap > 0 && memory_live >= memory_cap;
+}
+
+
+/*
+ * over the cap, with outbound buffers the publishers can wait for
+ */
+int
+amqp_memory_out_over_cap(void)
+{
+    return amqp_memory_over_cap() && memory_out > 0;
+}
+
+
+/*
+ * wait for a buffer to be freed, or for amqp_memory_wakeup()
+ */
+int
+amqp_memory_wait(void)
+{
+    return mnthr_cond_wait(&memory_room);
+}
+
+
+void
+amqp_memory_wakeup(void)
+{
+    mnthr_cond_signal_all(&memory_room);
+}
+
+
+/*
+ * Cap the body buffers of all connections at cap octets, zero is no cap.
+ */
+void
+mnamqp_set_memory_cap(size_t cap)
+{
+    memory_cap = cap;
+    mnthr_cond_signal_all(&memory_room);
+}
+
+
+void
+mnamqp_memory_stats(amqp_memory_stats_t *stats)
+{
+    stats->cap = memory_cap;
+    stats->live = memory_live;
+    stats->peak = memory_peak;
+    stats->out = memory_out;
+}
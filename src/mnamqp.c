@@ -1,10 +1,13 @@
 #include <assert.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <unistd.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/ip.h> // IPTOS_LOWDELAY
@@ -36,10 +39,16 @@ static int channel_expect_method(amqp_channel_t *,
                                  amqp_meth_id_t,
                                  amqp_frame_t **);
 static void channel_send_frame(amqp_channel_t *, amqp_frame_t *);
+static void channel_settle_confirm(amqp_channel_t *, uint64_t, int, int);
 static amqp_consumer_t *amqp_consumer_new(amqp_channel_t *, uint8_t);
 static void amqp_consumer_destroy(amqp_consumer_t **);
 static int amqp_consumer_item_fini(mnbytes_t *, amqp_consumer_t *);
 static amqp_pending_content_t *amqp_pending_content_new(void);
+static int consumer_deliver(amqp_consumer_t *, amqp_pending_content_t *);
+static void consumer_unthrottle(amqp_consumer_t *);
+static void channel_qos_arrival(amqp_channel_t *);
+static void channel_qos_handled(amqp_channel_t *, uint64_t, size_t);
+static void channel_consume_ok(amqp_channel_t *, amqp_basic_consume_ok_t *);
 
 amqp_conn_t *
 amqp_conn_new(const char *host,
@@ -85,12 +94,31 @@ amqp_conn_new(const char *host,
     conn->recv_thread = NULL;
     conn->send_thread = NULL;
     conn->heartbeat_thread = NULL;
-    STQUEUE_INIT(&conn->oframes);
+    DTQUEUE_INIT(&conn->ochannels);
+    conn->oframes = 0;
+    STQUEUE_INIT(&conn->ocontrol);
+    conn->oframes_bytes = 0;
     mnthr_signal_init(&conn->oframe_sig, NULL);
+    conn->send_high = 0;
+    conn->send_low = 0;
+    mnthr_cond_init(&conn->send_room);
+    mnthr_cond_init(&conn->stream_room);
+    conn->recv_throttled = 0;
+    conn->recv_waiters = 0;
+    mnthr_cond_init(&conn->recv_room);
     mnthr_signal_init(&conn->ping_sig, NULL);
+    conn->send_batch_frames = AMQP_SEND_BATCH_FRAMES_DEFAULT;
+    conn->send_batch_bytes = AMQP_SEND_BATCH_BYTES_DEFAULT;
+    conn->stats.oframes = 0;
+    conn->stats.oflushes = 0;
+    conn->stats.oblocks = 0;
+    conn->stats.ocontrol = 0;
+    conn->stats.mem_live = 0;
+    conn->stats.mem_peak = 0;
 
     conn->buffer_alloc = malloc;
     conn->buffer_free = free;
+    conn->slab = NULL;
 
     array_init(&conn->channels, sizeof(amqp_channel_t *), 0,
                NULL,
@@ -99,6 +127,8 @@ amqp_conn_new(const char *host,
     conn->error_code = 0;
     conn->error_msg = NULL;
     conn->closed = 1;
+    conn->send_noblock = 0;
+    conn->recv_mem_check = 0;
     return conn;
 }
 
@@ -208,7 +238,117 @@ err:
 size_t
 amqp_conn_oframes_length(amqp_conn_t *conn)
 {
-    return STQUEUE_LENGTH(&conn->oframes);
+    return conn->oframes + STQUEUE_LENGTH(&conn->ocontrol);
+}
+
+
+/*
+ * Limit the number of queued frames (nframes) and the size of the output
+ * buffer (nbytes) that the send thread coalesces into a single write.
+ * Zero leaves the respective limit unchanged, nframes of 1 gives one
+ * write per frame.
+ */
+void
+amqp_conn_set_send_batch(amqp_conn_t *conn, size_t nframes, size_t nbytes)
+{
+    if (nframes > 0) {
+        conn->send_batch_frames = nframes;
+    }
+    if (nbytes > 0) {
+        conn->send_batch_bytes = nbytes;
+    }
+}
+
+
+size_t
+amqp_conn_oframes_bytes(amqp_conn_t *conn)
+{
+    return conn->oframes_bytes;
+}
+
+
+/*
+ * Bound the octets of frames queued for the send thread.  A publish that
+ * finds the queue at or above high waits until it drains down to low, or
+ * with SEND_NOBLOCK in flags returns MNAMQP_SEND_WOULDBLOCK instead.  The
+ * check is done once per publish, so a content set is never split.  A high
+ * of zero turns the limit off.
+ */
+void
+amqp_conn_set_send_watermarks(amqp_conn_t *conn,
+                              size_t high,
+                              size_t low,
+                              int flags)
+{
+    assert(low <= high);
+    conn->send_high = high;
+    conn->send_low = low;
+    conn->send_noblock = (flags & SEND_NOBLOCK) ? 1 : 0;
+    mnthr_cond_signal_all(&conn->send_room);
+}
+
+
+/*
+ * Put a slab of power of two size classes up to frame_max in front of
+ * buffer_alloc and buffer_free, caching at most hwm octets of freed body
+ * buffers.  Set before the connection is run, the classes go up to the
+ * frame_max the broker tunes to.  Zero hwm releases the cache and turns
+ * the slab off.  A slab cannot be set up while body buffers are out: they
+ * would be freed into classes larger than they are, the call fails and
+ * leaves the allocator as it was.
+ */
+int
+amqp_conn_set_buffer_slab(amqp_conn_t *conn, size_t hwm)
+{
+    if (hwm > 0 && conn->stats.mem_live != 0) {
+        CTRACE("%ld octets of body buffers are out, slab not set",
+               (long)conn->stats.mem_live);
+        TRRET(AMQP_CONN_SET_BUFFER_SLAB + 1);
+    }
+    if (conn->slab != NULL) {
+        amqp_slab_destroy(&conn->slab);
+    }
+    if (hwm > 0) {
+        conn->slab = amqp_slab_new(conn->frame_max > 0 ?
+                                        conn->frame_max :
+                                        AMQP_BODY_CHUNK,
+                                   hwm,
+                                   conn->buffer_alloc,
+                                   conn->buffer_free);
+    }
+    return 0;
+}
+
+
+/*
+ * release cached body buffers down to keep octets
+ */
+void
+amqp_conn_trim_buffer_slab(amqp_conn_t *conn, size_t keep)
+{
+    if (conn->slab != NULL) {
+        amqp_slab_trim(conn->slab, keep);
+    }
+}
+
+
+void
+amqp_conn_get_slab_stats(amqp_conn_t *conn, amqp_slab_stats_t *stats)
+{
+    if (conn->slab != NULL) {
+        *stats = conn->slab->stats;
+    } else {
+        memset(stats, 0, sizeof(amqp_slab_stats_t));
+    }
+}
+
+
+void
+amqp_conn_get_stats(amqp_conn_t *conn, amqp_conn_stats_t *stats)
+{
+    *stats = conn->stats;
+    stats->oqueued_frames = amqp_conn_oframes_length(conn);
+    stats->oqueued_bytes = conn->oframes_bytes;
 }
 
 
@@ -218,13 +358,12 @@ amqp_pending_content_new(void)
 {
     amqp_pending_content_t *pc;
 
-    if ((pc = malloc(sizeof(amqp_pending_content_t))) == NULL) {
-        FAIL("malloc");
-    }
+    pc = amqp_pool_get(&amqp_pending_content_pool);
     STQUEUE_ENTRY_INIT(link, pc);
     pc->method = NULL;
     pc->header = NULL;
-    STQUEUE_INIT(&pc->body);
+    pc->data = NULL;
+    pc->stream_skip = 0;
     return pc;
 }
 
@@ -234,43 +373,341 @@ amqp_pending_content_destroy(amqp_consumer_t *cons,
                              amqp_pending_content_t **pc)
 {
     if (*pc != NULL) {
-        amqp_frame_t *fr;
-
+        if ((*pc)->data != NULL) {
+            amqp_conn_buffer_free(cons->chan->conn,
+                                  (*pc)->data,
+                                  (*pc)->header->payload.header->body_size);
+            (*pc)->data = NULL;
+        }
         amqp_frame_destroy_method(&(*pc)->method);
         amqp_frame_destroy_header(&(*pc)->header);
-        while ((fr = STQUEUE_HEAD(&(*pc)->body)) != NULL) {
-            STQUEUE_DEQUEUE(&(*pc)->body, link);
-            STQUEUE_ENTRY_FINI(link, fr);
-            amqp_frame_destroy_body(cons->chan->conn, &fr);
-        }
-        free(*pc);
+        amqp_pool_put(&amqp_pending_content_pool, *pc);
         *pc = NULL;
     }
 }
 
 
-static void
-receive_octets(amqp_conn_t *conn, amqp_frame_t *fr)
+/*
+ * Read sz payload octets into dst, or skip them if dst is NULL.  Octets
+ * already buffered in conn->ins are copied, a large remainder is read from
+ * the socket straight into dst.
+ */
+static int
+receive_octets(amqp_conn_t *conn, char *dst, size_t sz)
 {
-    ssize_t nread, need;
+    size_t nread, need;
 
     nread = 0;
-    assert(fr->payload.body == NULL);
-    if ((fr->payload.body = conn->buffer_alloc(fr->sz)) == NULL) {
-        FAIL("buffer_alloc");
-    }
-    while (nread < fr->sz) {
+    while (nread < sz) {
         if (SNEEDMORE(&conn->ins)) {
-            if (bytestream_consume_data(&conn->ins, (void *)(intptr_t)conn->fd) != 0) {
+            bytestream_rewind(&conn->ins);
+            if (dst != NULL && (sz - nread) >= AMQP_BODY_DIRECT_READ_MIN) {
+                if (mnthr_read_all(conn->fd, dst + nread, sz - nread) != 0) {
+                    return 1;
+                }
+                conn->last_sock_op = mnthr_get_now_nsec();
                 break;
             }
+            if (bytestream_consume_data(&conn->ins, (void *)(intptr_t)conn->fd) != 0) {
+                return 1;
+            }
             conn->last_sock_op = mnthr_get_now_nsec();
         }
-        need = MIN(fr->sz - nread, SEOD(&conn->ins) - SPOS(&conn->ins));
-        memcpy(fr->payload.body + nread, SPDATA(&conn->ins), need);
+        need = MIN(sz - nread, (size_t)SAVAIL(&conn->ins));
+        if (dst != NULL) {
+            memcpy(dst + nread, SPDATA(&conn->ins), need);
+        }
         SADVANCEPOS(&conn->ins, need);
         nread += need;
     }
+    return 0;
+}
+
+
+static int
+consumer_over_budget(amqp_consumer_t *cons)
+{
+    return (cons->pending_high > 0 &&
+            cons->flow_stats.pending >= cons->pending_high) ||
+           (cons->pending_bytes_high > 0 &&
+            cons->flow_stats.pending_bytes >= cons->pending_bytes_high);
+}
+
+
+/*
+ * A buffered delivery is complete: wake up the content thread, and stop
+ * reading the connection if the consumer is over its pending budget, or
+ * the body buffers over the memory cap.
+ * Only complete deliveries are held back this way, so the content thread
+ * can always drain them.
+ */
+static void
+consumer_content_complete(amqp_consumer_t *cons)
+{
+    mnthr_signal_send(&cons->content_sig);
+    cons->chan->conn->recv_mem_check = 1;
+    if (!cons->throttled && consumer_over_budget(cons)) {
+        cons->throttled = 1;
+        cons->throttled_since = mnthr_get_now_nsec();
+        ++cons->flow_stats.throttles;
+        ++cons->chan->conn->recv_throttled;
+    }
+}
+
+
+static void
+consumer_unthrottle(amqp_consumer_t *cons)
+{
+    amqp_conn_t *conn;
+
+    if (!cons->throttled) {
+        return;
+    }
+    conn = cons->chan->conn;
+    cons->throttled = 0;
+    cons->flow_stats.throttled_nsec +=
+        mnthr_get_now_nsec() - cons->throttled_since;
+    assert(conn->recv_throttled > 0);
+    if (--conn->recv_throttled == 0) {
+        mnthr_cond_signal_all(&conn->recv_room);
+    }
+}
+
+
+/*
+ * A thread is about to wait for a frame from the broker: throttled or
+ * over the memory cap, the receiving thread keeps reading until
+ * amqp_conn_recv_wait_end(), else a handler waiting for the broker would
+ * never see its reply.
+ */
+void
+amqp_conn_recv_wait_begin(amqp_conn_t *conn)
+{
+    if (conn->recv_waiters++ == 0) {
+        if (conn->recv_throttled > 0) {
+            mnthr_cond_signal_all(&conn->recv_room);
+        }
+        if (amqp_memory_over_cap()) {
+            amqp_memory_wakeup();
+        }
+    }
+}
+
+
+void
+amqp_conn_recv_wait_end(amqp_conn_t *conn)
+{
+    assert(conn->recv_waiters > 0);
+    --conn->recv_waiters;
+}
+
+
+/*
+ * a delivery left pending_content for its handler
+ */
+static void
+consumer_content_taken(amqp_consumer_t *cons, amqp_pending_content_t *pc)
+{
+    --cons->flow_stats.pending;
+    cons->flow_stats.pending_bytes -= pc->header->payload.header->body_size;
+    if (cons->throttled &&
+        cons->flow_stats.pending <= cons->pending_low &&
+        cons->flow_stats.pending_bytes <= cons->pending_bytes_low) {
+        consumer_unthrottle(cons);
+    }
+}
+
+
+/*
+ * the delivery that header and body frames are expected for; one that
+ * started before the consumer turned to streaming is still buffered
+ */
+static amqp_pending_content_t *
+consumer_receiving(amqp_consumer_t *cons)
+{
+    if (cons->stream_pc != NULL) {
+        return cons->stream_pc;
+    }
+    return STQUEUE_TAIL(&cons->pending_content);
+}
+
+
+/*
+ * Hand a delivery the application never sees back to the broker.
+ */
+static void
+channel_requeue_delivery(amqp_channel_t *chan, uint64_t delivery_tag)
+{
+    amqp_basic_reject_t *m;
+    amqp_frame_t *fr;
+
+    m = NEWREF(basic_reject)();
+    m->delivery_tag = delivery_tag;
+    m->flags = REJECT_REQUEUE;
+    fr = amqp_frame_new(chan->id, AMQP_FMETHOD);
+    fr->payload.params = (amqp_meth_params_t *)m;
+    channel_send_frame(chan, fr);
+}
+
+
+/*
+ * Streaming consumers get a delivery piece by piece on the receiving
+ * thread: header_cb once the header is in, chunk_cb for each body frame
+ * with a pointer valid for the call only, and content_cb with no data once
+ * the body is complete, to settle it as in consumer_deliver().
+ */
+static void
+consumer_stream_complete(amqp_consumer_t *cons)
+{
+    amqp_pending_content_t *pc;
+    int res;
+
+    pc = cons->stream_pc;
+    cons->stream_pc = NULL;
+    res = consumer_deliver(cons, pc);
+    amqp_pending_content_destroy(cons, &pc);
+    if (res != 0 && cons->stream_res == 0) {
+        /* stop the content thread, as a failing content_cb would */
+        cons->stream_res = res;
+        cons->closed = 1;
+        mnthr_signal_send(&cons->content_sig);
+    }
+}
+
+
+static void
+consumer_stream_header(amqp_consumer_t *cons, amqp_pending_content_t *pc)
+{
+    if (cons->header_cb != NULL &&
+        cons->header_cb(pc->method, pc->header, cons->content_udata) != 0) {
+        /* no chunks for this one, content_cb still decides */
+        pc->stream_skip = 1;
+    }
+    if (pc->header->payload.header->body_size == 0) {
+        consumer_stream_complete(cons);
+    }
+}
+
+
+static void
+consumer_stream_chunk(amqp_consumer_t *cons,
+                      amqp_pending_content_t *pc,
+                      const char *data,
+                      size_t sz)
+{
+    amqp_header_t *header;
+
+    header = pc->header->payload.header;
+    if (!pc->stream_skip &&
+        cons->chunk_cb(pc->method, data, sz, cons->content_udata) != 0) {
+        pc->stream_skip = 1;
+    }
+    if (header->_received_size == header->body_size) {
+        consumer_stream_complete(cons);
+    }
+}
+
+
+/*
+ * Body frames are not buffered whole: the payload goes directly to its
+ * offset in the message buffer allocated at the content header, or for a
+ * streaming consumer to its frame-sized buffer.
+ */
+static int
+next_body(amqp_conn_t *conn, amqp_frame_t *fr)
+{
+    uint8_t eof;
+    amqp_channel_t **chan;
+    amqp_consumer_t *cons;
+    amqp_pending_content_t *pc;
+    amqp_header_t *header;
+    char *dst;
+
+    cons = NULL;
+    pc = NULL;
+    header = NULL;
+    dst = NULL;
+
+    if ((chan = array_get(&conn->channels, fr->chan)) == NULL) {
+        TRRET(UNPACK + 240);
+    }
+    assert(*chan != NULL);
+
+    cons = (*chan)->content_consumer;
+    if (cons == NULL) {
+        CTRACE("got body, not found consumer, discarding frame");
+
+    } else {
+        pc = consumer_receiving(cons);
+        if (pc == NULL) {
+            CTRACE("got body, not found pending content, "
+                   "discarding frame");
+
+        } else if (pc->method == NULL || pc->header == NULL) {
+            /*
+             * XXX
+             */
+            CTRACE("found body when no previous method/header, "
+                   "discarding frame");
+
+        } else {
+            header = pc->header->payload.header;
+            if (header->_received_size + fr->sz > header->body_size) {
+                CTRACE("body exceeds body_size %"PRIu64", discarding frame",
+                       header->body_size);
+                header = NULL;
+            } else if (pc == cons->stream_pc) {
+                /* stream_buf holds one frame_max frame */
+                if (fr->sz > (size_t)conn->frame_max - 8) {
+                    CTRACE("body frame of %d exceeds frame_max %d",
+                           fr->sz, conn->frame_max);
+                    TRRET(UNPACK + 243);
+                }
+                /* frame_max may have been raised by connection.tune */
+                if (fr->sz > cons->stream_buf_sz) {
+                    if ((cons->stream_buf = realloc(cons->stream_buf,
+                                                    conn->frame_max)) ==
+                            NULL) {
+                        FAIL("realloc");
+                    }
+                    cons->stream_buf_sz = conn->frame_max;
+                }
+                dst = cons->stream_buf;
+            } else {
+                dst = pc->data + header->_received_size;
+            }
+        }
+    }
+
+#ifdef TRRET_DEBUG_VERBOSE
+    TRACEC("<<< ");
+    amqp_frame_dump(fr);
+    TRACEC("\n");
+#endif
+
+    if (receive_octets(conn, dst, fr->sz) != 0) {
+        TRRET(UNPACK_ECONSUME);
+    }
+
+    if (unpack_octet(&conn->ins, (void *)(intptr_t)conn->fd, &eof) < 0) {
+        TRRET(UNPACK + 241);
+    }
+
+    if (eof != 0xce) {
+        CTRACE("eof=%02hhx", eof);
+        TRRET(UNPACK + 242);
+    }
+
+    if (header != NULL) {
+        header->_received_size += fr->sz;
+        if (pc == cons->stream_pc) {
+            consumer_stream_chunk(cons, pc, dst, fr->sz);
+        } else if (header->_received_size == header->body_size) {
+            consumer_content_complete(cons);
+        }
+    }
+
+    return 0;
 }
 
 
@@ -304,6 +741,14 @@ next_frame(amqp_conn_t *conn)
     }
     //CTRACE("sz=%d", fr->sz);
 
+    if (fr->type == AMQP_FBODY) {
+        if ((res = next_body(conn, fr)) != 0) {
+            goto err;
+        }
+        amqp_frame_destroy(conn, &fr);
+        goto end;
+    }
+
     spos = SPOS(&conn->ins);
 
     SADVANCEPOS(&conn->ins, fr->sz);
@@ -379,9 +824,24 @@ next_frame(amqp_conn_t *conn)
                     if ((*chan)->default_consumer != NULL) {
                         (*chan)->content_consumer = (*chan)->default_consumer;
                     } else {
-                        CTRACE("got basic.deliver to %s, "
-                               "cannot find, discarding frame",
-                               BDATA(m->consumer_tag));
+                        /*
+                         * a delivery to a no-ack consumer is settled
+                         * already, rejecting it closes the channel, so
+                         * only reject if no consumer here is no-ack
+                         */
+                        if ((*chan)->noack_consumers == 0) {
+                            CTRACE("got basic.deliver to %s, "
+                                   "cannot find, requeueing it",
+                                   BDATA(m->consumer_tag));
+                            channel_requeue_delivery(*chan, m->delivery_tag);
+                        } else {
+                            CTRACE("got basic.deliver to %s, "
+                                   "cannot find, discarding it",
+                                   BDATA(m->consumer_tag));
+                        }
+                        amqp_delivery_tracker_add(&(*chan)->deliveries,
+                                                  m->delivery_tag,
+                                                  1);
                         amqp_frame_destroy_method(&fr);
                         (*chan)->content_consumer = NULL;
                     }
@@ -391,16 +851,43 @@ next_frame(amqp_conn_t *conn)
                 }
 
                 if ((*chan)->content_consumer != NULL) {
+                    amqp_delivery_tracker_add(
+                            &(*chan)->deliveries,
+                            m->delivery_tag,
+                            (*chan)->content_consumer->flags & CONSUME_FNOACK);
+                    channel_qos_arrival(*chan);
+                }
+
+                if ((*chan)->content_consumer != NULL) {
+                    amqp_consumer_t *cons;
                     amqp_pending_content_t *pc;
 
+                    cons = (*chan)->content_consumer;
                     pc = amqp_pending_content_new();
                     pc->method = fr;
-                    STQUEUE_ENQUEUE(
-                            &(*chan)->content_consumer->pending_content,
-                            link,
-                            pc);
-                    mnthr_signal_send(
-                            &(*chan)->content_consumer->content_sig);
+                    if (cons->chunk_cb != NULL) {
+                        if (cons->stream_pc != NULL) {
+                            amqp_basic_deliver_t *sm;
+
+                            sm = (amqp_basic_deliver_t *)
+                                cons->stream_pc->method->payload.params;
+                            CTRACE("incomplete delivery, discarding it");
+                            /* no-ack deliveries are settled already */
+                            if (amqp_delivery_tracker_settle(
+                                    &(*chan)->deliveries,
+                                    sm->delivery_tag) == 0) {
+                                channel_requeue_delivery(*chan,
+                                                         sm->delivery_tag);
+                            }
+                            amqp_pending_content_destroy(cons,
+                                                         &cons->stream_pc);
+                        }
+                        cons->stream_pc = pc;
+                    } else {
+                        STQUEUE_ENQUEUE(&cons->pending_content, link, pc);
+                        ++cons->flow_stats.pending;
+                        mnthr_signal_send(&cons->content_sig);
+                    }
                 }
 
             } else if (fr->payload.params->mi->mid == AMQP_BASIC_CANCEL) {
@@ -440,53 +927,22 @@ next_frame(amqp_conn_t *conn)
 
             } else if (fr->payload.params->mi->mid == AMQP_BASIC_ACK) {
                 amqp_basic_ack_t *m;
-                amqp_pending_pub_t *pp;
 
                 m = (amqp_basic_ack_t *)fr->payload.params;
-                if (m->flags & ACK_MULTIPLE) {
-                    while ((pp =
-                            DTQUEUE_HEAD(&(*chan)->pending_pub)) != NULL) {
-                        DTQUEUE_DEQUEUE(&(*chan)->pending_pub, link);
-                        DTQUEUE_ENTRY_FINI(link, pp);
-
-                        if (m->delivery_tag > pp->publish_tag) {
-                            mnthr_signal_send(&pp->sig);
-                        } else if (m->delivery_tag == pp->publish_tag) {
-                            mnthr_signal_send(&pp->sig);
-                            break;
-                        } else {
-                            CTRACE("got basic.ack deliver_tag=%ld "
-                                   "expected >=%ld",
-                                   m->delivery_tag, pp->publish_tag);
-                            // XXX might be already dead
-                            //mnthr_signal_error(&pp->sig, MNAMQP_PROTOCOL_ERROR);
-                        }
-                    }
-
-                    if (pp == NULL) {
-                        CTRACE("got basic.ack deliver_tag=%ld none expected",
-                               m->delivery_tag);
-                    }
-
-                } else {
-
-                    for (pp = DTQUEUE_HEAD(&(*chan)->pending_pub);
-                         pp != NULL;
-                         pp = DTQUEUE_NEXT(link, pp)) {
+                channel_settle_confirm(*chan,
+                                       m->delivery_tag,
+                                       m->flags & ACK_MULTIPLE,
+                                       0);
+                amqp_frame_destroy_method(&fr);
 
-                        if (pp->publish_tag == m->delivery_tag) {
-                            DTQUEUE_REMOVE(&(*chan)->pending_pub, link, pp);
-                            mnthr_signal_send(&pp->sig);
-                            break;
-                        }
-                    }
-                    if (pp == NULL) {
-                        CTRACE("got basic.ack deliver_tag=%ld "
-                               "none expected (dup?)",
-                               m->delivery_tag);
-                    }
-                }
+            } else if (fr->payload.params->mi->mid == AMQP_BASIC_NACK) {
+                amqp_basic_nack_t *m;
 
+                m = (amqp_basic_nack_t *)fr->payload.params;
+                channel_settle_confirm(*chan,
+                                       m->delivery_tag,
+                                       m->flags & ACK_MULTIPLE,
+                                       MNAMQP_CONFIRM_NACK);
                 amqp_frame_destroy_method(&fr);
 
             } else if (fr->payload.params->mi->mid == AMQP_CONNECTION_CLOSE) {
@@ -510,6 +966,13 @@ next_frame(amqp_conn_t *conn)
                 amqp_frame_destroy_method(&fr);
 
             } else {
+                if (fr->payload.params->mi->mid == AMQP_BASIC_CONSUME_OK &&
+                    (*chan)->consume_pending != NULL) {
+                    /* deliveries may follow before the consumer wakes up */
+                    channel_consume_ok(*chan,
+                                       (amqp_basic_consume_ok_t *)
+                                       fr->payload.params);
+                }
                 STQUEUE_ENQUEUE(&(*chan)->iframes, link, fr);
                 mnthr_signal_send(&(*chan)->expect_sig);
             }
@@ -538,7 +1001,7 @@ next_frame(amqp_conn_t *conn)
             } else  {
                 amqp_pending_content_t *pc;
 
-                pc = STQUEUE_TAIL(&cons->pending_content);
+                pc = consumer_receiving(cons);
                 if (pc == NULL) {
                     CTRACE("got header, not found pending content, "
                            "discarding frame");
@@ -569,9 +1032,24 @@ next_frame(amqp_conn_t *conn)
                                    fr->payload.header->class_id, class_id);
                             amqp_frame_destroy_header(&fr);
 
+                        } else if (pc == cons->stream_pc) {
+                            pc->header = fr;
+                            consumer_stream_header(cons, pc);
+
                         } else {
                             pc->header = fr;
-                            mnthr_signal_send(&cons->content_sig);
+                            if ((pc->data = amqp_conn_buffer_alloc(
+                                    conn,
+                                    fr->payload.header->body_size)) == NULL) {
+                                FAIL("buffer_alloc");
+                            }
+                            cons->flow_stats.pending_bytes +=
+                                fr->payload.header->body_size;
+                            if (fr->payload.header->body_size == 0) {
+                                consumer_content_complete(cons);
+                            } else {
+                                mnthr_signal_send(&cons->content_sig);
+                            }
                         }
                     }
                 }
@@ -579,55 +1057,9 @@ next_frame(amqp_conn_t *conn)
         }
         break;
 
-    case AMQP_FBODY:
+    case AMQP_FHEARTBEAT:
         {
-            amqp_consumer_t *cons;
-
-            /*
-             * XXX implement it
-             */
-            receive_octets(conn, fr);
-
-#ifdef TRRET_DEBUG_VERBOSE
-            TRACEC("<<< ");
-            amqp_frame_dump(fr);
-            TRACEC("\n");
-#endif
-            cons = (*chan)->content_consumer;
-
-            if (cons == NULL) {
-                CTRACE("got body, not found consumer, discarding frame");
-                amqp_frame_destroy_body(cons->chan->conn, &fr);
-
-            } else {
-                amqp_pending_content_t *pc;
-
-                pc = STQUEUE_TAIL(&cons->pending_content);
-                if (pc == NULL) {
-                    CTRACE("got body, not found pending content, "
-                           "discarding frame");
-                    amqp_frame_destroy_body(cons->chan->conn, &fr);
-                } else {
-                    if (pc->method == NULL || pc->header == NULL) {
-                        /*
-                         * XXX
-                         */
-                        CTRACE("found body when no previous method/header, "
-                               "discarding frame");
-                        amqp_frame_destroy_body(cons->chan->conn, &fr);
-
-                    } else {
-                        STQUEUE_ENQUEUE(&pc->body, link, fr);
-                        mnthr_signal_send(&cons->content_sig);
-                    }
-                }
-            }
-        }
-        break;
-
-    case AMQP_FHEARTBEAT:
-        {
-            amqp_frame_t *fr1;
+            amqp_frame_t *fr1;
 
 #ifdef TRRET_DEBUG_VERBOSE
             TRACEC("<<< ");
@@ -688,13 +1120,35 @@ recv_thread_worker(UNUSED int argc, void **argv)
         if (SNEEDMORE(&conn->ins)) {
             bytestream_rewind(&conn->ins);
         }
+
+        /* let the socket buffer fill up until the consumers catch up */
+        while (conn->recv_throttled > 0 &&
+               conn->recv_waiters == 0 &&
+               !conn->closed) {
+            if (mnthr_cond_wait(&conn->recv_room) != 0) {
+                goto end;
+            }
+        }
+
+        /* and until the memory cap allows for another delivery */
+        if (conn->recv_mem_check) {
+            conn->recv_mem_check = 0;
+            while (amqp_memory_over_cap() &&
+                   conn->recv_waiters == 0 &&
+                   !conn->closed) {
+                if (amqp_memory_wait() != 0) {
+                    goto end;
+                }
+            }
+        }
     }
 
+end:
     return 0;
 }
 
 
-static void
+static int
 pack_frame(amqp_conn_t *conn, amqp_frame_t *fr)
 {
     union {
@@ -702,7 +1156,7 @@ pack_frame(amqp_conn_t *conn, amqp_frame_t *fr)
         char *c;
     } u;
 
-    pack_octet(&conn->outs, fr->type);
+    pack_octet(&conn->outs, AMQP_FRAME_WIRE_TYPE(fr->type));
     pack_short(&conn->outs, fr->chan);
 
     switch (fr->type) {
@@ -742,6 +1196,42 @@ pack_frame(amqp_conn_t *conn, amqp_frame_t *fr)
         }
         break;
 
+    case AMQP_FMETHODRAW:
+        assert(fr->payload.raw.tpl != NULL);
+        pack_long(&conn->outs, SEOD(&fr->payload.raw.tpl->method));
+        (void)bytestream_cat(&conn->outs,
+                             SEOD(&fr->payload.raw.tpl->method),
+                             SDATA(&fr->payload.raw.tpl->method, 0));
+        break;
+
+    case AMQP_FHEADERRAW:
+        {
+            const char *props;
+            size_t sz;
+
+            /*
+             * class-id, weight, body-size, then the properties built for
+             * this message, the message's, or the template's
+             */
+            if (fr->payload.raw.props != NULL) {
+                props = fr->payload.raw.props;
+                sz = fr->payload.raw.props_sz;
+            } else if (fr->payload.raw.msg != NULL) {
+                props = SDATA(fr->payload.raw.msg->props, 0);
+                sz = SEOD(fr->payload.raw.msg->props);
+            } else {
+                assert(fr->payload.raw.tpl != NULL);
+                props = SDATA(&fr->payload.raw.tpl->props, 0);
+                sz = SEOD(&fr->payload.raw.tpl->props);
+            }
+            pack_long(&conn->outs, AMQP_HEADERRAW_SIZE(sz));
+            pack_short(&conn->outs, AMQP_BASIC);
+            pack_short(&conn->outs, 0);
+            pack_longlong(&conn->outs, fr->payload.raw.body_size);
+            (void)bytestream_cat(&conn->outs, sz, props);
+        }
+        break;
+
     case AMQP_FBODY:
         assert(fr->sz > 0);
         pack_long(&conn->outs, fr->sz);
@@ -754,6 +1244,80 @@ pack_frame(amqp_conn_t *conn, amqp_frame_t *fr)
         (void)fr->payload.bodyex.cb(conn, fr->payload.bodyex.udata);
         break;
 
+    case AMQP_FBODYREF:
+        assert(fr->sz > 0);
+        pack_long(&conn->outs, fr->sz);
+        assert(fr->payload.bodyref.data != NULL);
+        if (fr->sz < AMQP_BODYREF_WRITE_MIN) {
+            (void)bytestream_cat(&conn->outs,
+                                 fr->sz,
+                                 fr->payload.bodyref.data);
+        } else {
+            /*
+             * flush what is packed so far, and write the body straight
+             * from the referenced buffer
+             */
+            if (bytestream_produce_data(&conn->outs,
+                                        (void *)(intptr_t)conn->fd) != 0) {
+                return 1;
+            }
+            ++conn->stats.oflushes;
+            bytestream_rewind(&conn->outs);
+            if (mnthr_write_all(conn->fd,
+                                fr->payload.bodyref.data,
+                                fr->sz) != 0) {
+                return 1;
+            }
+        }
+        break;
+
+    case AMQP_FBODYV:
+        {
+            const struct iovec *iov;
+            size_t off, sz;
+
+            assert(fr->sz > 0);
+            pack_long(&conn->outs, fr->sz);
+            assert(fr->payload.bodyv.iov != NULL);
+            /*
+             * as with AMQP_FBODYREF, small frames are copied, and large
+             * ones written segment by segment after a flush
+             */
+            if (fr->sz >= AMQP_BODYREF_WRITE_MIN) {
+                if (bytestream_produce_data(
+                            &conn->outs,
+                            (void *)(intptr_t)conn->fd) != 0) {
+                    return 1;
+                }
+                ++conn->stats.oflushes;
+                bytestream_rewind(&conn->outs);
+            }
+            iov = fr->payload.bodyv.iov;
+            off = fr->payload.bodyv.off;
+            sz = fr->sz;
+            while (sz > 0) {
+                size_t n;
+
+                while (off >= iov->iov_len) {
+                    ++iov;
+                    off = 0;
+                }
+                n = MIN(sz, iov->iov_len - off);
+                if (fr->sz < AMQP_BODYREF_WRITE_MIN) {
+                    (void)bytestream_cat(&conn->outs,
+                                         n,
+                                         (char *)iov->iov_base + off);
+                } else if (mnthr_write_all(conn->fd,
+                                           (char *)iov->iov_base + off,
+                                           n) != 0) {
+                    return 1;
+                }
+                off += n;
+                sz -= n;
+            }
+        }
+        break;
+
     case AMQP_FHEARTBEAT:
         assert(fr->sz == 0);
         pack_long(&conn->outs, fr->sz);
@@ -766,6 +1330,7 @@ pack_frame(amqp_conn_t *conn, amqp_frame_t *fr)
     pack_octet(&conn->outs, 0xce);
 
     //D16(SDATA(&conn->outs, 0), SEOD(&conn->outs));
+    return 0;
 }
 
 
@@ -779,29 +1344,64 @@ send_thread_worker(UNUSED int argc, void **argv)
     mnthr_signal_init(&conn->oframe_sig, mnthr_me());
     while (!conn->closed) {
         amqp_frame_t *fr;
+        size_t nframes;
+        size_t obytes;
 
-        if ((fr = STQUEUE_HEAD(&conn->oframes)) == NULL) {
+        if (DTQUEUE_EMPTY(&conn->ochannels) &&
+            STQUEUE_EMPTY(&conn->ocontrol)) {
             if (mnthr_signal_subscribe(&conn->oframe_sig) != 0) {
                 break;
             }
-        } else {
-            STQUEUE_DEQUEUE(&conn->oframes, link);
-            STQUEUE_ENTRY_FINI(link, fr);
+            continue;
+        }
+
+        /*
+         * pack as many queued frames as the batch limits allow, and
+         * flush them in one write
+         */
+        bytestream_rewind(&conn->outs);
+        nframes = 0;
+        obytes = conn->oframes_bytes;
+        while ((fr = amqp_conn_next_oframe(conn)) != NULL) {
 
 #ifdef TRRET_DEBUG_VERBOSE
             TRACEC(">>> ");
             amqp_frame_dump(fr);
             TRACEC("\n");
 #endif
-            bytestream_rewind(&conn->outs);
-            pack_frame(conn, fr);
+            if (pack_frame(conn, fr) != 0) {
+                amqp_frame_destroy(conn, &fr);
+                goto end;
+            }
             amqp_frame_destroy(conn, &fr);
-            if (bytestream_produce_data(&conn->outs, (void *)(intptr_t)conn->fd) != 0) {
+            ++nframes;
+
+            if (nframes >= conn->send_batch_frames ||
+                (size_t)SEOD(&conn->outs) >= conn->send_batch_bytes) {
                 break;
             }
-            conn->last_sock_op = mnthr_get_now_nsec();
+        }
+
+        if (bytestream_produce_data(&conn->outs, (void *)(intptr_t)conn->fd) != 0) {
+            break;
+        }
+        conn->last_sock_op = mnthr_get_now_nsec();
+        conn->stats.oframes += nframes;
+        ++conn->stats.oflushes;
+
+        /* wake up waiters once the queue drops below their mark */
+        if (conn->send_high > 0 &&
+            obytes > conn->send_low &&
+            conn->oframes_bytes <= conn->send_low) {
+            mnthr_cond_signal_all(&conn->send_room);
+        }
+        if (obytes > AMQP_BODY_STREAM_QUEUED &&
+            conn->oframes_bytes <= AMQP_BODY_STREAM_QUEUED) {
+            mnthr_cond_signal_all(&conn->stream_room);
         }
     }
+
+end:
     mnthr_signal_fini(&conn->oframe_sig);
     return 0;
 }
@@ -978,6 +1578,16 @@ amqp_conn_run(amqp_conn_t *conn)
         goto err;
     }
 
+    /*
+     * a slab set up before tune may be too small for payload_max buffers,
+     * it can be replaced as long as none of its buffers are out
+     */
+    if (conn->slab != NULL &&
+        conn->slab->max < conn->frame_max &&
+        conn->stats.mem_live == 0) {
+        (void)amqp_conn_set_buffer_slab(conn, conn->slab->hwm);
+    }
+
     // >>> connection_open
     fr1 = amqp_frame_new(conn->chan0->id, AMQP_FMETHOD);
     opn = NEWREF(connection_open)();
@@ -1043,6 +1653,10 @@ amqp_conn_close_fd(amqp_conn_t *conn)
         conn->fd = -1;
     }
     conn->closed = 1;
+    mnthr_cond_signal_all(&conn->send_room);
+    mnthr_cond_signal_all(&conn->stream_room);
+    mnthr_cond_signal_all(&conn->recv_room);
+    amqp_memory_wakeup();
 }
 
 
@@ -1052,6 +1666,7 @@ consumer_stop_threads_cb(UNUSED mnbytes_t *key,
                          UNUSED void *udata)
 {
     cons->closed = 1;
+    consumer_unthrottle(cons);
     if (mnthr_signal_has_owner(&cons->content_sig)) {
         mnthr_signal_error(&cons->content_sig, MNAMQP_STOP_THREADS);
     }
@@ -1066,10 +1681,22 @@ consumer_stop_threads_cb(UNUSED mnbytes_t *key,
 }
 
 
+static void
+channel_stop_qos(amqp_channel_t *chan)
+{
+    if (chan->qos_thread != NULL) {
+        (void)mnthr_set_interrupt_and_join(chan->qos_thread);
+        chan->qos_thread = NULL;
+    }
+}
+
+
 static int
 channel_stop_threads_cb(amqp_channel_t **chan, UNUSED void *udata)
 {
     (*chan)->closed = 1;
+    mnthr_cond_signal_all(&(*chan)->confirm_cond);
+    channel_stop_qos(*chan);
 
     (void)hash_traverse(&(*chan)->consumers,
                         (hash_traverser_t)consumer_stop_threads_cb, NULL);
@@ -1248,15 +1875,21 @@ amqp_conn_destroy(amqp_conn_t **conn)
         amqp_conn_close_fd(*conn); //sanity
 
         array_fini(&(*conn)->channels);
-        while ((fr = STQUEUE_HEAD(&(*conn)->oframes)) != NULL) {
-            STQUEUE_DEQUEUE(&(*conn)->oframes, link);
+        /* channels have dropped their own outgoing frames */
+        DTQUEUE_FINI(&(*conn)->ochannels);
+        while ((fr = STQUEUE_HEAD(&(*conn)->ocontrol)) != NULL) {
+            STQUEUE_DEQUEUE(&(*conn)->ocontrol, link);
             STQUEUE_ENTRY_FINI(link, fr);
             amqp_frame_destroy(*conn, &fr);
         }
-        STQUEUE_FINI(&(*conn)->oframes);
+        STQUEUE_FINI(&(*conn)->ocontrol);
+        mnthr_cond_fini(&(*conn)->send_room);
+        mnthr_cond_fini(&(*conn)->stream_room);
+        mnthr_cond_fini(&(*conn)->recv_room);
 
         bytestream_fini(&(*conn)->ins);
         bytestream_fini(&(*conn)->outs);
+        amqp_slab_destroy(&(*conn)->slab);
 
         if ((*conn)->host != NULL) {
             free((*conn)->host);
@@ -1293,6 +1926,12 @@ amqp_channel_new(amqp_conn_t *conn)
     }
     (*chan)->conn = conn;
     (*chan)->id = conn->channels.elnum - 1;
+    STQUEUE_INIT(&(*chan)->oframes);
+    DTQUEUE_ENTRY_INIT(olink, *chan);
+    (*chan)->odeficit = 0;
+    (*chan)->oweight = 1;
+    STQUEUE_INIT(&(*chan)->oparked);
+    (*chan)->ostream = 0;
     STQUEUE_INIT(&(*chan)->iframes);
     mnthr_signal_init(&(*chan)->expect_sig, NULL);
     mnthr_sema_init(&(*chan)->sync_sema, 1);
@@ -1302,8 +1941,24 @@ amqp_channel_new(amqp_conn_t *conn)
               (hash_item_finalizer_t)amqp_consumer_item_fini);
     (*chan)->content_consumer = NULL;
     (*chan)->default_consumer = NULL;
+    (*chan)->consume_pending = NULL;
+    (*chan)->noack_consumers = 0;
     (*chan)->publish_tag = 0ll;
-    DTQUEUE_INIT(&(*chan)->pending_pub);
+    amqp_confirm_tracker_init(&(*chan)->confirms);
+    (*chan)->confirm_cb = NULL;
+    (*chan)->confirm_udata = NULL;
+    (*chan)->confirm_window = 0;
+    mnthr_cond_init(&(*chan)->confirm_cond);
+    amqp_delivery_tracker_init(&(*chan)->deliveries);
+    (*chan)->ack_batch = 0;
+    (*chan)->ack_batch_nsec = 0;
+    memset(&(*chan)->ack_stats, 0, sizeof(amqp_consumer_ack_stats_t));
+    (*chan)->qos_thread = NULL;
+    (*chan)->qos_min = 0;
+    (*chan)->qos_max = 0;
+    (*chan)->qos_interval = 0;
+    (*chan)->qos_last_arrival = 0;
+    memset(&(*chan)->qos_stats, 0, sizeof(amqp_qos_stats_t));
     (*chan)->confirm_mode = 0;
     (*chan)->closed = 1;
     return *chan;
@@ -1320,8 +1975,210 @@ amqp_channel_iframes_length(amqp_channel_t *chan)
 static void
 channel_send_frame(amqp_channel_t *chan, amqp_frame_t *fr)
 {
-    STQUEUE_ENQUEUE(&chan->conn->oframes, link, fr);
-    mnthr_signal_send(&chan->conn->oframe_sig);
+    amqp_conn_t *conn;
+    amqp_channel_t **frchan;
+
+    conn = chan->conn;
+    /* chan0 also sends channel.open on behalf of the new channel */
+    if ((frchan = array_get(&conn->channels, fr->chan)) != NULL &&
+        *frchan != NULL) {
+        chan = *frchan;
+    }
+
+    amqp_conn_queue_oframe(conn, chan, fr);
+    mnthr_signal_send(&conn->oframe_sig);
+}
+
+
+/*
+ * publisher confirms
+ */
+static void
+confirm_settle_cb(amqp_confirm_slot_t *slot,
+                  uint64_t tag,
+                  int status,
+                  void *udata)
+{
+    amqp_channel_t *chan;
+
+    chan = udata;
+    if (chan->confirm_cb != NULL) {
+        chan->confirm_cb(chan, tag, status, chan->confirm_udata);
+        mnthr_cond_signal_all(&chan->confirm_cond);
+
+    } else if (slot->pp != NULL) {
+        if (status == 0) {
+            mnthr_signal_send(&slot->pp->sig);
+        } else {
+            mnthr_signal_error(&slot->pp->sig, status);
+        }
+    }
+}
+
+
+static void
+channel_settle_confirm(amqp_channel_t *chan,
+                       uint64_t tag,
+                       int multiple,
+                       int status)
+{
+    if (amqp_confirm_tracker_settle(&chan->confirms,
+                                    tag,
+                                    multiple,
+                                    status,
+                                    confirm_settle_cb,
+                                    chan) == 0) {
+        CTRACE("got confirm delivery_tag=%ld none expected%s",
+               tag,
+               multiple ? "" : " (dup?)");
+    }
+}
+
+
+/*
+ * In the asynchronous confirm mode, block the publisher while the window
+ * of unconfirmed publishes is full.  Called before content is queued.
+ */
+static int
+channel_confirm_window_wait(amqp_channel_t *chan)
+{
+    if (chan->confirm_cb == NULL || chan->confirm_window == 0) {
+        return 0;
+    }
+    while (chan->confirms.npending >= chan->confirm_window) {
+        int res;
+
+        amqp_conn_recv_wait_begin(chan->conn);
+        res = mnthr_cond_wait(&chan->confirm_cond);
+        amqp_conn_recv_wait_end(chan->conn);
+        if (res != 0 || chan->closed) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Called before content is queued: above the send high watermark, wait
+ * for the send thread to drain the queue down to the low one.
+ */
+static int
+channel_send_room_wait(amqp_channel_t *chan)
+{
+    amqp_conn_t *conn;
+
+    conn = chan->conn;
+    if (conn->send_high == 0 || conn->oframes_bytes < conn->send_high) {
+        return 0;
+    }
+    if (conn->send_noblock) {
+        return MNAMQP_SEND_WOULDBLOCK;
+    }
+    ++conn->stats.oblocks;
+    while (conn->send_high > 0 && conn->oframes_bytes > conn->send_low) {
+        if (mnthr_cond_wait(&conn->send_room) != 0) {
+            return 1;
+        }
+        if (conn->closed || chan->closed) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Above the memory cap, wait for outbound body buffers to be written out.
+ * Deliveries are not waited for, they may be the caller's own.
+ */
+static int
+channel_memory_wait(amqp_channel_t *chan)
+{
+    amqp_conn_t *conn;
+
+    if (!amqp_memory_out_over_cap()) {
+        return 0;
+    }
+    conn = chan->conn;
+    if (conn->send_noblock) {
+        return MNAMQP_SEND_WOULDBLOCK;
+    }
+    ++conn->stats.oblocks;
+    while (amqp_memory_out_over_cap()) {
+        if (amqp_memory_wait() != 0) {
+            return 1;
+        }
+        if (conn->closed || chan->closed) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * everything a publish waits for before queuing its frames
+ */
+static int
+channel_publish_wait(amqp_channel_t *chan)
+{
+    int res;
+
+    if ((res = channel_confirm_window_wait(chan)) != 0) {
+        return res;
+    }
+    if ((res = channel_send_room_wait(chan)) != 0) {
+        return res;
+    }
+    return channel_memory_wait(chan);
+}
+
+
+/*
+ * Called after content is queued: assign the publish tag, and in the
+ * synchronous confirm mode wait for the broker's basic.ack.
+ */
+static int
+channel_publish_confirm(amqp_channel_t *chan, int errid)
+{
+    int res;
+
+    res = 0;
+    if (!chan->confirm_mode) {
+        return res;
+    }
+
+    if (chan->confirm_cb != NULL) {
+        chan->publish_tag = amqp_confirm_tracker_add(&chan->confirms,
+                                                     NULL,
+                                                     mnthr_get_now_nsec());
+
+    } else {
+        amqp_pending_pub_t pp;
+
+        mnthr_signal_init(&pp.sig, mnthr_me());
+        pp.publish_tag = amqp_confirm_tracker_add(&chan->confirms,
+                                                  &pp,
+                                                  mnthr_get_now_nsec());
+        chan->publish_tag = pp.publish_tag;
+
+        amqp_conn_recv_wait_begin(chan->conn);
+        res = mnthr_signal_subscribe(&pp.sig);
+        amqp_conn_recv_wait_end(chan->conn);
+        if (res != 0) {
+            if (res != MNAMQP_CONFIRM_NACK) {
+                amqp_confirm_tracker_forget(&chan->confirms, pp.publish_tag);
+            }
+            if (res != MNAMQP_PROTOCOL_ERROR &&
+                res != MNAMQP_CONFIRM_NACK) {
+                res = errid;
+            }
+        }
+        mnthr_signal_fini(&pp.sig);
+    }
+
+    return res;
 }
 
 
@@ -1338,9 +2195,11 @@ channel_expect_method(amqp_channel_t *chan,
     assert(!mnthr_signal_has_owner(&chan->expect_sig));
 
     mnthr_signal_init(&chan->expect_sig, mnthr_me());
-    res = 0;
 
-    if (mnthr_signal_subscribe(&chan->expect_sig) != 0) {
+    amqp_conn_recv_wait_begin(chan->conn);
+    res = mnthr_signal_subscribe(&chan->expect_sig);
+    amqp_conn_recv_wait_end(chan->conn);
+    if (res != 0) {
         res = CHANNEL_EXPECT_METHOD + 1;
         TR(res);
         goto err;
@@ -1401,12 +2260,39 @@ amqp_channel_destroy(amqp_channel_t **chan)
             STQUEUE_ENTRY_FINI(link, fr);
             amqp_frame_destroy((*chan)->conn, &fr);
         }
+        if (!STQUEUE_EMPTY(&(*chan)->oframes)) {
+            DTQUEUE_REMOVE(&(*chan)->conn->ochannels, olink, *chan);
+            while ((fr = STQUEUE_HEAD(&(*chan)->oframes)) != NULL) {
+                STQUEUE_DEQUEUE(&(*chan)->oframes, link);
+                STQUEUE_ENTRY_FINI(link, fr);
+                --(*chan)->conn->oframes;
+                (*chan)->conn->oframes_bytes -=
+                    AMQP_FRAME_OVERHEAD + fr->sz;
+                amqp_frame_destroy((*chan)->conn, &fr);
+            }
+        }
+        while ((fr = STQUEUE_HEAD(&(*chan)->oparked)) != NULL) {
+            STQUEUE_DEQUEUE(&(*chan)->oparked, link);
+            STQUEUE_ENTRY_FINI(link, fr);
+            amqp_frame_destroy((*chan)->conn, &fr);
+        }
         /* must have been finalized in channel_expect_method() */
         if (mnthr_signal_has_owner(&(*chan)->expect_sig)) {
             //CTRACE("signal owner has owner %p", (*chan)->expect_sig.owner);
             //mnthr_dump((*chan)->expect_sig.owner);
         }
         assert(!mnthr_signal_has_owner(&(*chan)->expect_sig));
+        if ((*chan)->confirm_cb != NULL) {
+            (void)amqp_confirm_tracker_settle(&(*chan)->confirms,
+                                              (*chan)->confirms.next - 1,
+                                              1,
+                                              MNAMQP_STOP_THREADS,
+                                              confirm_settle_cb,
+                                              *chan);
+        }
+        amqp_confirm_tracker_fini(&(*chan)->confirms);
+        amqp_delivery_tracker_fini(&(*chan)->deliveries);
+        mnthr_cond_fini(&(*chan)->confirm_cond);
         hash_fini(&(*chan)->consumers);
         amqp_consumer_destroy(&(*chan)->default_consumer);
         mnthr_sema_fini(&(*chan)->sync_sema);
@@ -1561,12 +2447,67 @@ amqp_channel_confirm(amqp_channel_t *chan, uint8_t flags)
                                     AMQP_CONFIRM_SELECT_OK,
                                     AMQP_CCONFIRM,
         m->flags = flags;
-        chan->confirm_mode = 1;
-        chan->publish_tag = 0ll;,,
+        chan->confirm_mode = 1;,,
     )
 }
 
 
+/*
+ * Put the channel in confirm mode without blocking publishers on each
+ * basic.ack: publishes return as soon as their content is queued, and
+ * cb(chan, publish_tag, status, udata) is called from the receiving thread
+ * with status 0 on basic.ack, MNAMQP_CONFIRM_NACK on basic.nack, and
+ * MNAMQP_STOP_THREADS for publishes left unconfirmed when the channel goes
+ * away.  Publishers block only while window publishes are unconfirmed, zero
+ * window means no limit.  cb must not block.
+ */
+int
+amqp_channel_confirm_async(amqp_channel_t *chan,
+                           size_t window,
+                           amqp_channel_confirm_cb_t cb,
+                           void *udata)
+{
+    assert(cb != NULL);
+    chan->confirm_cb = cb;
+    chan->confirm_udata = udata;
+    chan->confirm_window = window;
+    return amqp_channel_confirm(chan, 0);
+}
+
+
+/*
+ * The publish tag of the most recent publish on the channel in confirm
+ * mode, matches the tag passed to the confirm callback.
+ */
+uint64_t
+amqp_channel_publish_tag(amqp_channel_t *chan)
+{
+    return chan->publish_tag;
+}
+
+
+/*
+ * The tag of the oldest unconfirmed publish and how long ago it was
+ * queued, in nanoseconds.  Return non-zero if all publishes are
+ * confirmed.
+ */
+int
+amqp_channel_oldest_unconfirmed(amqp_channel_t *chan,
+                                uint64_t *tag,
+                                uint64_t *age)
+{
+    amqp_confirm_slot_t *slot;
+
+    if ((slot = amqp_confirm_tracker_oldest(&chan->confirms, tag)) == NULL) {
+        return 1;
+    }
+    if (age != NULL) {
+        *age = mnthr_get_now_nsec() - slot->ts;
+    }
+    return 0;
+}
+
+
 int
 amqp_channel_declare_exchange(amqp_channel_t *chan,
                               const char *exchange,
@@ -1812,50 +2753,299 @@ amqp_channel_qos(amqp_channel_t *chan,
 }
 
 
-int
-amqp_channel_flow(amqp_channel_t *chan,
-                  uint8_t flags)
-{
-    AMQP_CHANNEL_METHOD_PAIR(channel_flow,
-                             AMQP_CHANNEL_FLOW_OK,
-                             AMQP_FLOW,
-        m->flags = flags;,,
-    )
-}
+/*
+ * adaptive prefetch
+ */
+#define AMQP_QOS_EWMA(avg, sample)                     \
+    ((avg) == 0 ? (sample) : (avg) - (avg) / 8 + (sample) / 8)
 
+static void
+channel_qos_arrival(amqp_channel_t *chan)
+{
+    uint64_t now;
 
+    if (chan->qos_thread == NULL) {
+        return;
+    }
+    now = mnthr_get_now_nsec();
+    if (chan->qos_last_arrival != 0) {
+        chan->qos_stats.arrival_nsec =
+            AMQP_QOS_EWMA(chan->qos_stats.arrival_nsec,
+                          now - chan->qos_last_arrival);
+    }
+    chan->qos_last_arrival = now;
+}
+
+
+/*
+ * n deliveries handled since the given time
+ */
+static void
+channel_qos_handled(amqp_channel_t *chan, uint64_t since, size_t n)
+{
+    if (chan->qos_thread == NULL || n == 0) {
+        return;
+    }
+    chan->qos_stats.handler_nsec =
+        AMQP_QOS_EWMA(chan->qos_stats.handler_nsec,
+                      (mnthr_get_now_nsec() - since) / n);
+}
+
+
+/*
+ * amqp_channel_qos() with the time basic.qos was queued at, after the wait
+ * for sync_sema
+ */
+static int
+channel_qos_sent(amqp_channel_t *chan,
+                 uint16_t prefetch_count,
+                 uint64_t *sent)
+{
+    AMQP_CHANNEL_METHOD_PAIR(basic_qos,
+                             AMQP_BASIC_QOS_OK,
+                             AMQP_QOS,
+        m->prefetch_size = 0;
+        m->prefetch_count = prefetch_count;
+        m->flags = 0;
+        *sent = mnthr_get_now_nsec();,,
+    )
+}
+
+
+static int
+channel_qos_timed(amqp_channel_t *chan, uint16_t prefetch_count)
+{
+    int res;
+    uint64_t start;
+
+    if ((res = channel_qos_sent(chan, prefetch_count, &start)) != 0) {
+        return res;
+    }
+    chan->qos_stats.rtt_nsec = AMQP_QOS_EWMA(chan->qos_stats.rtt_nsec,
+                                             mnthr_get_now_nsec() - start);
+    chan->qos_stats.prefetch_count = prefetch_count;
+    return 0;
+}
+
+
+static int
+consumer_depth_cb(UNUSED mnbytes_t *key, amqp_consumer_t *cons, size_t *depth)
+{
+    *depth += STQUEUE_LENGTH(&cons->pending_content) +
+              STQUEUE_LENGTH(&cons->batch_content);
+    return 0;
+}
+
+
+/*
+ * Deliveries the handlers get through in a basic.qos round trip, twice
+ * over so that one window is in flight while the other is handled.  A
+ * handler left waiting for deliveries grows the window past that.
+ */
+static uint16_t
+channel_qos_target(amqp_channel_t *chan)
+{
+    amqp_qos_stats_t *st;
+    uint64_t target;
+
+    st = &chan->qos_stats;
+    target = 2 * (st->rtt_nsec / MAX(st->handler_nsec, 1)) + 1;
+    if (st->depth == 0 && st->arrival_nsec > st->handler_nsec) {
+        target = MAX(target,
+                     (uint64_t)st->prefetch_count +
+                        st->prefetch_count / 4 + 1);
+    }
+    target = MAX(target, chan->qos_min);
+    target = MIN(target, chan->qos_max);
+    return (uint16_t)target;
+}
+
+
+static int
+qos_thread_worker(UNUSED int argc, void **argv)
+{
+    amqp_channel_t *chan;
+
+    assert(argc == 1);
+    chan = argv[0];
+    while (!chan->closed) {
+        uint16_t target;
+        unsigned diff;
+
+        if (mnthr_sleep(chan->qos_interval) != 0) {
+            break;
+        }
+        chan->qos_stats.depth = 0;
+        (void)hash_traverse(&chan->consumers,
+                            (hash_traverser_t)consumer_depth_cb,
+                            &chan->qos_stats.depth);
+        if (chan->default_consumer != NULL) {
+            (void)consumer_depth_cb(NULL,
+                                    chan->default_consumer,
+                                    &chan->qos_stats.depth);
+        }
+        if (chan->qos_stats.handler_nsec == 0) {
+            /* nothing handled yet */
+            continue;
+        }
+
+        target = channel_qos_target(chan);
+        diff = target > chan->qos_stats.prefetch_count ?
+            target - chan->qos_stats.prefetch_count :
+            chan->qos_stats.prefetch_count - target;
+        /* ignore jitter */
+        if (diff == 0 || diff < chan->qos_stats.prefetch_count / 8u) {
+            continue;
+        }
+        if (channel_qos_timed(chan, target) != 0) {
+            break;
+        }
+        ++chan->qos_stats.adjustments;
+    }
+    return 0;
+}
+
+
+/*
+ * Let prefetch_count follow the consumers of the channel: every msec
+ * re-issue basic.qos, between min and max, for the deliveries that the
+ * handlers get through in a basic.qos round trip, see
+ * channel_qos_target().  Starts at min.  Prefetch stays as it is after
+ * amqp_close_channel().
+ */
 int
-amqp_channel_publish(amqp_channel_t *chan,
-                     const char *exchange,
-                     const char *routing_key,
-                     uint8_t flags,
-                     amqp_header_completion_cb cb,
-                     void *udata,
-                     const char *data,
-                     ssize_t sz)
+amqp_channel_qos_auto(amqp_channel_t *chan,
+                      uint16_t min,
+                      uint16_t max,
+                      uint64_t msec)
 {
     int res;
+
+    assert(min > 0);
+    assert(min <= max);
+    assert(msec > 0);
+    channel_stop_qos(chan);
+    chan->qos_min = min;
+    chan->qos_max = max;
+    chan->qos_interval = msec;
+    if ((res = channel_qos_timed(chan, min)) != 0) {
+        return res;
+    }
+    chan->qos_last_arrival = 0;
+    chan->qos_thread = MNTHR_SPAWN("amqqos", qos_thread_worker, chan);
+    return 0;
+}
+
+
+void
+amqp_channel_get_qos_stats(amqp_channel_t *chan, amqp_qos_stats_t *stats)
+{
+    *stats = chan->qos_stats;
+}
+
+
+int
+amqp_channel_flow(amqp_channel_t *chan,
+                  uint8_t flags)
+{
+    AMQP_CHANNEL_METHOD_PAIR(channel_flow,
+                             AMQP_CHANNEL_FLOW_OK,
+                             AMQP_FLOW,
+        m->flags = flags;,,
+    )
+}
+
+
+/*
+ * queue a copy of data as body frames of at most payload_max octets
+ */
+static void
+channel_send_body(amqp_channel_t *chan, const char *data, ssize_t sz)
+{
     amqp_frame_t *fr1;
-    amqp_basic_publish_t *m;
-    amqp_header_t *h;
 
-    res = 0;
+    while (sz > chan->conn->payload_max) {
+        fr1 = amqp_frame_new(chan->id, AMQP_FBODY);
+        fr1->sz = chan->conn->payload_max;
+        if ((fr1->payload.body = amqp_conn_obuffer_alloc(
+                        chan->conn, chan->conn->payload_max)) == NULL) {
+            FAIL("buffer_alloc");
+        }
+        memcpy(fr1->payload.body, data, chan->conn->payload_max);
+        channel_send_frame(chan, fr1);
 
-    assert(routing_key != NULL);
-    assert(exchange != NULL);
+        data += chan->conn->payload_max;
+        sz -= chan->conn->payload_max;
+    }
+    if (sz > 0) {
+        fr1 = amqp_frame_new(chan->id, AMQP_FBODY);
+        fr1->sz = sz;
+        if ((fr1->payload.body = amqp_conn_obuffer_alloc(chan->conn,
+                                                         sz)) == NULL) {
+            FAIL("buffer_alloc");
+        }
+        memcpy(fr1->payload.body, data, sz);
+        channel_send_frame(chan, fr1);
+    }
+}
+
+
+/*
+ * Everything a publish does before queuing its frames: take the channel,
+ * content must not interleave with other frames on it (4.2.6 Content
+ * Framing), and wait as in channel_publish_wait().  errid is for a closed
+ * channel, errid + 1 for the channel not taken.  On failure the channel
+ * is not held, and release(release_udata) is called if given.
+ */
+static int
+channel_publish_begin(amqp_channel_t *chan,
+                      amqp_body_release_cb_t release,
+                      void *release_udata,
+                      int errid)
+{
+    int res;
+
+    res = 0;
 
     if (chan->closed) {
-        TRRET(CHANNEL_PUBLISH + 1);
+        res = errid;
+        goto err;
     }
 
-    /*
-     * 4.2.6 Content Framing: content should be synchronized with
-     *   non-content.
-     */
     if (mnthr_sema_acquire(&chan->sync_sema) != 0) {
-        TRRET(CHANNEL_PUBLISH + 2);
+        res = errid + 1;
+        goto err;
+    }
+
+    if ((res = channel_publish_wait(chan)) != 0) {
+        mnthr_sema_release(&chan->sync_sema);
+        if (res != MNAMQP_SEND_WOULDBLOCK) {
+            res = CHANNEL_PUBLISH + 8;
+            goto err;
+        }
     }
 
+end:
+    if (res != 0 && release != NULL) {
+        release(release_udata);
+    }
+    return res;
+
+err:
+    TR(res);
+    goto end;
+}
+
+
+static void
+channel_send_publish_method(amqp_channel_t *chan,
+                            const char *exchange,
+                            const char *routing_key,
+                            uint8_t flags)
+{
+    amqp_frame_t *fr1;
+    amqp_basic_publish_t *m;
+
     fr1 = amqp_frame_new(chan->id, AMQP_FMETHOD);
     m = NEWREF(basic_publish)();
     m->exchange = bytes_new_from_str(exchange);
@@ -1863,6 +3053,26 @@ amqp_channel_publish(amqp_channel_t *chan,
     m->flags = flags;
     fr1->payload.params = (amqp_meth_params_t *)m;
     channel_send_frame(chan, fr1);
+}
+
+
+/*
+ * queue basic.publish, and the content header for a body of sz octets,
+ * with properties set by cb(chan, header, udata)
+ */
+static void
+channel_send_publish_method_header(amqp_channel_t *chan,
+                                   const char *exchange,
+                                   const char *routing_key,
+                                   uint8_t flags,
+                                   amqp_header_completion_cb cb,
+                                   void *udata,
+                                   ssize_t sz)
+{
+    amqp_frame_t *fr1;
+    amqp_header_t *h;
+
+    channel_send_publish_method(chan, exchange, routing_key, flags);
 
     fr1 = amqp_frame_new(chan->id, AMQP_FHEADER);
     h = amqp_header_new();
@@ -1873,48 +3083,66 @@ amqp_channel_publish(amqp_channel_t *chan,
     }
     fr1->payload.header = h;
     channel_send_frame(chan, fr1);
+}
 
-    while (sz > chan->conn->payload_max) {
-        fr1 = amqp_frame_new(chan->id, AMQP_FBODY);
-        fr1->sz = chan->conn->payload_max;
-        if ((fr1->payload.body = chan->conn->buffer_alloc(
-                        chan->conn->payload_max)) == NULL) {
-            FAIL("buffer_alloc");
-        }
-        memcpy(fr1->payload.body, data, chan->conn->payload_max);
-        channel_send_frame(chan, fr1);
 
-        data += chan->conn->payload_max;
-        sz -= chan->conn->payload_max;
-    }
-    if (sz > 0) {
-        fr1 = amqp_frame_new(chan->id, AMQP_FBODY);
-        fr1->sz = sz;
-        if ((fr1->payload.body = chan->conn->buffer_alloc(sz)) == NULL) {
-            FAIL("buffer_alloc");
-        }
-        memcpy(fr1->payload.body, data, sz);
+/*
+ * queue body frames referring to slices of data, each holding ref
+ */
+static void
+channel_send_body_ref(amqp_channel_t *chan,
+                      const char *data,
+                      ssize_t sz,
+                      amqp_body_ref_t *ref)
+{
+    amqp_frame_t *fr1;
+
+    while (sz > 0) {
+        fr1 = amqp_frame_new(chan->id, AMQP_FBODYREF);
+        fr1->sz = MIN(sz, (ssize_t)chan->conn->payload_max);
+        fr1->payload.bodyref.data = data;
+        fr1->payload.bodyref.ref = ref;
+        amqp_body_ref_incref(ref);
         channel_send_frame(chan, fr1);
+
+        data += fr1->sz;
+        sz -= fr1->sz;
     }
-    fr1 = NULL;
+}
 
-    if (chan->confirm_mode) {
-        amqp_pending_pub_t pp;
 
-        DTQUEUE_ENTRY_INIT(link, &pp);
-        mnthr_signal_init(&pp.sig, mnthr_me());
-        pp.publish_tag = ++chan->publish_tag;
+int
+amqp_channel_publish(amqp_channel_t *chan,
+                     const char *exchange,
+                     const char *routing_key,
+                     uint8_t flags,
+                     amqp_header_completion_cb cb,
+                     void *udata,
+                     const char *data,
+                     ssize_t sz)
+{
+    int res;
 
-        DTQUEUE_ENQUEUE(&chan->pending_pub, link, &pp);
-        if ((res = mnthr_signal_subscribe(&pp.sig)) != 0) {
-            DTQUEUE_REMOVE(&chan->pending_pub, link, &pp);
-            if (res != MNAMQP_PROTOCOL_ERROR) {
-                res = CHANNEL_PUBLISH + 2;
-            }
-        }
-        mnthr_signal_fini(&pp.sig);
+    assert(routing_key != NULL);
+    assert(exchange != NULL);
+
+    if ((res = channel_publish_begin(chan,
+                                     NULL,
+                                     NULL,
+                                     CHANNEL_PUBLISH + 1)) != 0) {
+        return res;
     }
 
+    channel_send_publish_method_header(chan,
+                                       exchange,
+                                       routing_key,
+                                       flags,
+                                       cb,
+                                       udata,
+                                       sz);
+    channel_send_body(chan, data, sz);
+
+    res = channel_publish_confirm(chan, CHANNEL_PUBLISH + 2);
 
     mnthr_sema_release(&chan->sync_sema);
     return res;
@@ -1931,8 +3159,6 @@ amqp_channel_publish_ex(amqp_channel_t *chan,
 {
     int res;
     amqp_frame_t *fr1;
-    amqp_basic_publish_t *m;
-    ssize_t sz;
 
     res = 0;
 
@@ -1943,59 +3169,22 @@ amqp_channel_publish_ex(amqp_channel_t *chan,
         TRRET(CHANNEL_PUBLISH + 3);
     }
 
-    fr1 = amqp_frame_new(chan->id, AMQP_FMETHOD);
-    m = NEWREF(basic_publish)();
-    m->exchange = bytes_new_from_str(exchange);
-    m->routing_key = bytes_new_from_str(routing_key);
-    m->flags = flags;
-    fr1->payload.params = (amqp_meth_params_t *)m;
-    channel_send_frame(chan, fr1);
+    if ((res = channel_publish_wait(chan)) != 0) {
+        if (res == MNAMQP_SEND_WOULDBLOCK) {
+            return res;
+        }
+        TRRET(CHANNEL_PUBLISH + 8);
+    }
+
+    channel_send_publish_method(chan, exchange, routing_key, flags);
 
     fr1 = amqp_frame_new(chan->id, AMQP_FHEADER);
     fr1->payload.header = header;
-    sz = header->body_size;
     channel_send_frame(chan, fr1);
 
-    while (sz > chan->conn->payload_max) {
-        fr1 = amqp_frame_new(chan->id, AMQP_FBODY);
-        fr1->sz = chan->conn->payload_max;
-        if ((fr1->payload.body = chan->conn->buffer_alloc(
-                        chan->conn->payload_max)) == NULL) {
-            FAIL("buffer_alloc");
-        }
-        memcpy(fr1->payload.body, data, chan->conn->payload_max);
-        channel_send_frame(chan, fr1);
-
-        data += chan->conn->payload_max;
-        sz -= chan->conn->payload_max;
-    }
-    if (sz > 0) {
-        fr1 = amqp_frame_new(chan->id, AMQP_FBODY);
-        fr1->sz = sz;
-        if ((fr1->payload.body = chan->conn->buffer_alloc(sz)) == NULL) {
-            FAIL("buffer_alloc");
-        }
-        memcpy(fr1->payload.body, data, sz);
-        channel_send_frame(chan, fr1);
-    }
-    fr1 = NULL;
-
-    if (chan->confirm_mode) {
-        amqp_pending_pub_t pp;
-
-        DTQUEUE_ENTRY_INIT(link, &pp);
-        mnthr_signal_init(&pp.sig, mnthr_me());
-        pp.publish_tag = ++chan->publish_tag;
+    channel_send_body(chan, data, header->body_size);
 
-        DTQUEUE_ENQUEUE(&chan->pending_pub, link, &pp);
-        if ((res = mnthr_signal_subscribe(&pp.sig)) != 0) {
-            DTQUEUE_REMOVE(&chan->pending_pub, link, &pp);
-            if (res != MNAMQP_PROTOCOL_ERROR) {
-                res = CHANNEL_PUBLISH + 4;
-            }
-        }
-        mnthr_signal_fini(&pp.sig);
-    }
+    res = channel_publish_confirm(chan, CHANNEL_PUBLISH + 4);
 
     return res;
 }
@@ -2013,7 +3202,6 @@ amqp_channel_publish_ex2(amqp_channel_t *chan,
 {
     int res;
     amqp_frame_t *fr1;
-    amqp_basic_publish_t *m;
 
     res = 0;
 
@@ -2024,13 +3212,14 @@ amqp_channel_publish_ex2(amqp_channel_t *chan,
         TRRET(CHANNEL_PUBLISH + 4);
     }
 
-    fr1 = amqp_frame_new(chan->id, AMQP_FMETHOD);
-    m = NEWREF(basic_publish)();
-    m->exchange = bytes_new_from_str(exchange);
-    m->routing_key = bytes_new_from_str(routing_key);
-    m->flags = flags;
-    fr1->payload.params = (amqp_meth_params_t *)m;
-    channel_send_frame(chan, fr1);
+    if ((res = channel_publish_wait(chan)) != 0) {
+        if (res == MNAMQP_SEND_WOULDBLOCK) {
+            return res;
+        }
+        TRRET(CHANNEL_PUBLISH + 8);
+    }
+
+    channel_send_publish_method(chan, exchange, routing_key, flags);
 
     fr1 = amqp_frame_new(chan->id, AMQP_FHEADER);
     fr1->payload.header = header;
@@ -2038,30 +3227,572 @@ amqp_channel_publish_ex2(amqp_channel_t *chan,
     channel_send_frame(chan, fr1);
 
     fr1 = amqp_frame_new(chan->id, AMQP_FBODYEX);
+    /* what cb is going to write, as far as the send queue is concerned */
+    fr1->sz = header->body_size;
     fr1->payload.bodyex.cb = cb;
     fr1->payload.bodyex.udata = udata;
     channel_send_frame(chan, fr1);
 
     fr1 = NULL;
 
-    if (chan->confirm_mode) {
-        amqp_pending_pub_t pp;
+    res = channel_publish_confirm(chan, CHANNEL_PUBLISH + 4);
 
-        DTQUEUE_ENTRY_INIT(link, &pp);
-        mnthr_signal_init(&pp.sig, mnthr_me());
-        pp.publish_tag = ++chan->publish_tag;
+    return res;
+}
+
+
+/*
+ * Publish a body without copying it: body frames refer to slices of data,
+ * and release(release_udata) is called once the last of them is written
+ * out (or discarded), after which data may be reused.
+ */
+int
+amqp_channel_publish_ref(amqp_channel_t *chan,
+                         const char *exchange,
+                         const char *routing_key,
+                         uint8_t flags,
+                         amqp_header_completion_cb cb,
+                         void *udata,
+                         const char *data,
+                         ssize_t sz,
+                         amqp_body_release_cb_t release,
+                         void *release_udata)
+{
+    int res;
+    amqp_body_ref_t *ref;
+
+    assert(routing_key != NULL);
+    assert(exchange != NULL);
+
+    if ((res = channel_publish_begin(chan,
+                                     release,
+                                     release_udata,
+                                     CHANNEL_PUBLISH + 5)) != 0) {
+        return res;
+    }
+
+    channel_send_publish_method_header(chan,
+                                       exchange,
+                                       routing_key,
+                                       flags,
+                                       cb,
+                                       udata,
+                                       sz);
+
+    ref = amqp_body_ref_new(release, release_udata);
+    channel_send_body_ref(chan, data, sz, ref);
+    /* the frames hold the buffer from now on */
+    amqp_body_ref_decref(&ref);
+
+    res = channel_publish_confirm(chan, CHANNEL_PUBLISH + 7);
+
+    mnthr_sema_release(&chan->sync_sema);
+    return res;
+}
+
+
+static void
+message_ref_release(void *udata)
+{
+    amqp_message_t *msg;
+
+    msg = udata;
+    amqp_message_release(&msg);
+}
+
+
+/*
+ * Publish a received message again without copying: the header
+ * properties are encoded once per message and shared by its publishes,
+ * and the body frames point into the message, which is retained until
+ * they are written out.  The caller keeps its reference.
+ */
+int
+amqp_channel_publish_message(amqp_channel_t *chan,
+                             const char *exchange,
+                             const char *routing_key,
+                             uint8_t flags,
+                             amqp_message_t *msg)
+{
+    int res;
+    amqp_frame_t *fr1;
+    amqp_body_ref_t *ref;
+    ssize_t sz;
+
+    assert(routing_key != NULL);
+    assert(exchange != NULL);
+    assert(msg->header != NULL);
+
+    if ((res = channel_publish_begin(chan,
+                                     NULL,
+                                     NULL,
+                                     CHANNEL_PUBLISH + 17)) != 0) {
+        return res;
+    }
+
+    if (msg->props == NULL) {
+        if ((msg->props = malloc(sizeof(mnbytestream_t))) == NULL) {
+            FAIL("malloc");
+        }
+        bytestream_init(msg->props, 256);
+        amqp_header_enc_props(msg->header->payload.header, msg->props);
+    }
+
+    channel_send_publish_method(chan, exchange, routing_key, flags);
+
+    sz = msg->header->payload.header->body_size;
+    fr1 = amqp_frame_new(chan->id, AMQP_FHEADERRAW);
+    fr1->payload.raw.tpl = NULL;
+    fr1->payload.raw.body_size = sz;
+    fr1->payload.raw.props = NULL;
+    fr1->payload.raw.props_sz = 0;
+    fr1->payload.raw.msg = amqp_message_retain(msg);
+    fr1->sz = AMQP_HEADERRAW_SIZE(SEOD(msg->props));
+    channel_send_frame(chan, fr1);
+
+    ref = amqp_body_ref_new(message_ref_release, amqp_message_retain(msg));
+    channel_send_body_ref(chan, msg->data, sz, ref);
+    /* the frames hold the message from now on */
+    amqp_body_ref_decref(&ref);
+
+    res = channel_publish_confirm(chan, CHANNEL_PUBLISH + 19);
+
+    mnthr_sema_release(&chan->sync_sema);
+    return res;
+}
+
+
+/*
+ * Publish through a template: the method frame and the header properties
+ * are copied as they were encoded by amqp_publish_template_new(), only the
+ * body size is filled in.  If hb is not NULL, the header properties come
+ * from it instead, and hb may be reset as soon as this returns.
+ */
+int
+amqp_channel_publish_template(amqp_channel_t *chan,
+                              amqp_publish_template_t *tpl,
+                              amqp_header_builder_t *hb,
+                              const char *data,
+                              ssize_t sz)
+{
+    int res;
+    amqp_frame_t *fr1;
+
+    assert(tpl != NULL);
+
+    if ((res = channel_publish_begin(chan,
+                                     NULL,
+                                     NULL,
+                                     CHANNEL_PUBLISH + 9)) != 0) {
+        return res;
+    }
+
+    fr1 = amqp_frame_new(chan->id, AMQP_FMETHODRAW);
+    fr1->payload.raw.tpl = tpl;
+    fr1->sz = SEOD(&tpl->method);
+    amqp_publish_template_incref(tpl);
+    channel_send_frame(chan, fr1);
+
+    fr1 = amqp_frame_new(chan->id, AMQP_FHEADERRAW);
+    fr1->payload.raw.tpl = tpl;
+    fr1->payload.raw.body_size = sz;
+    fr1->payload.raw.props = NULL;
+    fr1->payload.raw.props_sz = 0;
+    fr1->payload.raw.msg = NULL;
+    if (hb != NULL) {
+        fr1->payload.raw.props_sz = amqp_header_builder_size(hb);
+        if ((fr1->payload.raw.props =
+                    amqp_conn_obuffer_alloc(chan->conn,
+                                            fr1->payload.raw.props_sz)) ==
+                NULL) {
+            FAIL("buffer_alloc");
+        }
+        amqp_header_builder_copy(hb, fr1->payload.raw.props);
+        fr1->sz = AMQP_HEADERRAW_SIZE(fr1->payload.raw.props_sz);
+    } else {
+        fr1->sz = AMQP_HEADERRAW_SIZE(SEOD(&tpl->props));
+    }
+    amqp_publish_template_incref(tpl);
+    channel_send_frame(chan, fr1);
+
+    channel_send_body(chan, data, sz);
+
+    res = channel_publish_confirm(chan, CHANNEL_PUBLISH + 21);
+
+    mnthr_sema_release(&chan->sync_sema);
+    return res;
+}
+
+
+/*
+ * Publish a body gathered from iovcnt segments of iov, sz octets in total,
+ * without copying it: body frames refer to the segments, and may span
+ * several of them.  The iovec array is copied, the segments are released
+ * as in amqp_channel_publish_ref().  Fail if the segments do not add up
+ * to sz.
+ */
+int
+amqp_channel_publishv(amqp_channel_t *chan,
+                      const char *exchange,
+                      const char *routing_key,
+                      uint8_t flags,
+                      amqp_header_completion_cb cb,
+                      void *udata,
+                      const struct iovec *iov,
+                      int iovcnt,
+                      ssize_t sz,
+                      amqp_body_release_cb_t release,
+                      void *release_udata)
+{
+    int res;
+    amqp_frame_t *fr1;
+    amqp_body_ref_t *ref;
+    size_t off;
+    ssize_t total;
+    int i;
+
+    assert(routing_key != NULL);
+    assert(exchange != NULL);
+    assert(iovcnt >= 0);
+
+    /* frames are cut from the segments by sz, they must hold it exactly */
+    total = 0;
+    for (i = 0; i < iovcnt; ++i) {
+        total += iov[i].iov_len;
+    }
+    if (total != sz) {
+        if (release != NULL) {
+            release(release_udata);
+        }
+        TRRET(CHANNEL_PUBLISH + 20);
+    }
+
+    if ((res = channel_publish_begin(chan,
+                                     release,
+                                     release_udata,
+                                     CHANNEL_PUBLISH + 11)) != 0) {
+        return res;
+    }
+
+    channel_send_publish_method_header(chan,
+                                       exchange,
+                                       routing_key,
+                                       flags,
+                                       cb,
+                                       udata,
+                                       sz);
+
+    ref = amqp_body_ref_new(release, release_udata);
+    if (iovcnt > 0) {
+        if ((ref->iov = malloc(sizeof(struct iovec) * iovcnt)) == NULL) {
+            FAIL("malloc");
+        }
+        memcpy(ref->iov, iov, sizeof(struct iovec) * iovcnt);
+    }
+    /* cut frames at payload_max, regardless of segment boundaries */
+    i = 0;
+    off = 0;
+    while (sz > 0) {
+        size_t n;
+
+        assert(i < iovcnt);
+        fr1 = amqp_frame_new(chan->id, AMQP_FBODYV);
+        fr1->sz = MIN(sz, (ssize_t)chan->conn->payload_max);
+        fr1->payload.bodyv.iov = &ref->iov[i];
+        fr1->payload.bodyv.off = off;
+        fr1->payload.bodyv.ref = ref;
+        amqp_body_ref_incref(ref);
+        channel_send_frame(chan, fr1);
+
+        for (n = fr1->sz; n > 0;) {
+            size_t nn;
 
-        DTQUEUE_ENQUEUE(&chan->pending_pub, link, &pp);
-        if ((res = mnthr_signal_subscribe(&pp.sig)) != 0) {
-            DTQUEUE_REMOVE(&chan->pending_pub, link, &pp);
-            if (res != MNAMQP_PROTOCOL_ERROR) {
-                res = CHANNEL_PUBLISH + 4;
+            assert(i < iovcnt);
+            nn = MIN(n, ref->iov[i].iov_len - off);
+            n -= nn;
+            off += nn;
+            if (off == ref->iov[i].iov_len) {
+                ++i;
+                off = 0;
             }
         }
-        mnthr_signal_fini(&pp.sig);
+        sz -= fr1->sz;
+    }
+    fr1 = NULL;
+    amqp_body_ref_decref(&ref);
+
+    res = channel_publish_confirm(chan, CHANNEL_PUBLISH + 22);
+
+    mnthr_sema_release(&chan->sync_sema);
+    return res;
+}
+
+
+static void
+body_map_release(void *udata)
+{
+    amqp_body_map_t *map;
+
+    map = udata;
+    if (map->addr != NULL) {
+        (void)munmap(map->addr, map->len);
+    }
+    if (map->release != NULL) {
+        map->release(map->udata);
+    }
+    free(map);
+}
+
+
+/*
+ * Publish sz octets of the file fd from offset as the body.  The range is
+ * mapped, and body frames refer to the mapping as in
+ * amqp_channel_publish_ref(): nothing is copied or read up front, and
+ * memory use does not depend on sz.  The send thread faults the pages in
+ * as it writes them out, and like any disk read under mnthr, a page not
+ * in the page cache stalls every thread until it is read.  The range must
+ * stay unchanged, the file must not be truncated, until
+ * release(release_udata) is called; fd may be closed once this returns.
+ */
+int
+amqp_channel_publish_fd(amqp_channel_t *chan,
+                        const char *exchange,
+                        const char *routing_key,
+                        uint8_t flags,
+                        amqp_header_completion_cb cb,
+                        void *udata,
+                        int fd,
+                        off_t offset,
+                        ssize_t sz,
+                        amqp_body_release_cb_t release,
+                        void *release_udata)
+{
+    int res;
+    amqp_body_map_t *map;
+    amqp_body_ref_t *ref;
+    off_t start;
+
+    assert(routing_key != NULL);
+    assert(exchange != NULL);
+    assert(fd >= 0);
+
+    if ((res = channel_publish_begin(chan,
+                                     release,
+                                     release_udata,
+                                     CHANNEL_PUBLISH + 13)) != 0) {
+        return res;
+    }
+
+    if ((map = malloc(sizeof(amqp_body_map_t))) == NULL) {
+        FAIL("malloc");
+    }
+    map->addr = NULL;
+    map->len = 0;
+    map->release = release;
+    map->udata = release_udata;
+    start = offset;
+    if (sz > 0) {
+        /* mmap() takes page aligned offsets only */
+        start = offset - offset % sysconf(_SC_PAGESIZE);
+        map->len = offset - start + sz;
+        if ((map->addr = mmap(NULL,
+                              map->len,
+                              PROT_READ,
+                              MAP_SHARED,
+                              fd,
+                              start)) == MAP_FAILED) {
+            map->addr = NULL;
+            body_map_release(map);
+            mnthr_sema_release(&chan->sync_sema);
+            TRRET(CHANNEL_PUBLISH + 25);
+        }
+    }
+
+    channel_send_publish_method_header(chan,
+                                       exchange,
+                                       routing_key,
+                                       flags,
+                                       cb,
+                                       udata,
+                                       sz);
+
+    ref = amqp_body_ref_new(body_map_release, map);
+    channel_send_body_ref(chan,
+                          (char *)map->addr + (offset - start),
+                          sz,
+                          ref);
+    /* the frames hold the mapping from now on */
+    amqp_body_ref_decref(&ref);
+
+    res = channel_publish_confirm(chan, CHANNEL_PUBLISH + 23);
+
+    mnthr_sema_release(&chan->sync_sema);
+    return res;
+}
+
+
+/*
+ * Fill a body frame of sz octets from produce, AMQP_BODY_CHUNK octets at
+ * most per call.
+ */
+static amqp_frame_t *
+channel_produce_body(amqp_channel_t *chan,
+                     ssize_t sz,
+                     amqp_body_producer_cb_t produce,
+                     void *produce_udata)
+{
+    amqp_frame_t *fr;
+    ssize_t off;
+
+    fr = amqp_frame_new(chan->id, AMQP_FBODY);
+    fr->sz = sz;
+    if ((fr->payload.body = amqp_conn_obuffer_alloc(chan->conn,
+                                                    sz)) == NULL) {
+        FAIL("buffer_alloc");
+    }
+    for (off = 0; off < sz;) {
+        ssize_t n;
+
+        n = produce(fr->payload.body + off,
+                    MIN(sz - off, AMQP_BODY_CHUNK),
+                    produce_udata);
+        if (n <= 0 || n > MIN(sz - off, AMQP_BODY_CHUNK)) {
+            amqp_frame_destroy(chan->conn, &fr);
+            break;
+        }
+        off += n;
+    }
+    return fr;
+}
+
+
+/*
+ * between the body frames of a streamed publish, see
+ * AMQP_BODY_STREAM_QUEUED
+ */
+static int
+channel_stream_room_wait(amqp_channel_t *chan)
+{
+    amqp_conn_t *conn;
+
+    conn = chan->conn;
+    while (conn->oframes_bytes > AMQP_BODY_STREAM_QUEUED) {
+        if (mnthr_cond_wait(&conn->stream_room) != 0) {
+            return 1;
+        }
+        if (conn->closed || chan->closed) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Publish a body of sz octets generated on demand: produce(buf, n,
+ * produce_udata) is called from the publishing thread to fill the next
+ * at most AMQP_BODY_CHUNK octets, one body frame at a time.  Frames are
+ * cut at payload_max, so the producer never deals with framing, and the
+ * body is never held in memory as a whole: once more than
+ * AMQP_BODY_STREAM_QUEUED octets are queued, the producer waits for the
+ * send thread.  produce must deliver exactly sz octets in total, zero or
+ * less fails the publish.  If it fails within the first frame, nothing is
+ * sent.  Later, the broker has been promised sz octets and there is no
+ * way to take that back: the connection is shut down.  Other frames of
+ * the channel, acks for instance, are held back until the last body frame
+ * is queued.  release(release_udata) is called before this returns.
+ */
+int
+amqp_channel_publish_stream(amqp_channel_t *chan,
+                            const char *exchange,
+                            const char *routing_key,
+                            uint8_t flags,
+                            amqp_header_completion_cb cb,
+                            void *udata,
+                            ssize_t sz,
+                            amqp_body_producer_cb_t produce,
+                            void *produce_udata,
+                            amqp_body_release_cb_t release,
+                            void *release_udata)
+{
+    int res;
+    amqp_frame_t *fr1;
+
+    assert(routing_key != NULL);
+    assert(exchange != NULL);
+    assert(produce != NULL);
+
+    if ((res = channel_publish_begin(chan,
+                                     release,
+                                     release_udata,
+                                     CHANNEL_PUBLISH + 15)) != 0) {
+        return res;
+    }
+
+    /* a producer failing right away costs nothing yet */
+    fr1 = NULL;
+    if (sz > 0 &&
+        (fr1 = channel_produce_body(chan,
+                                    MIN(sz, chan->conn->payload_max),
+                                    produce,
+                                    produce_udata)) == NULL) {
+        res = CHANNEL_PUBLISH + 26;
+        goto err;
     }
 
+    channel_send_publish_method_header(chan,
+                                       exchange,
+                                       routing_key,
+                                       flags,
+                                       cb,
+                                       udata,
+                                       sz);
+    /* other writers of this channel do not take sync_sema */
+    amqp_conn_stream_begin(chan->conn, chan);
+
+    while (fr1 != NULL) {
+        sz -= fr1->sz;
+        amqp_conn_queue_stream_oframe(chan->conn, chan, fr1);
+        mnthr_signal_send(&chan->conn->oframe_sig);
+        fr1 = NULL;
+        if (sz == 0) {
+            break;
+        }
+        if (channel_stream_room_wait(chan) != 0) {
+            res = CHANNEL_PUBLISH + 27;
+            goto err;
+        }
+        if ((fr1 = channel_produce_body(chan,
+                                        MIN(sz, chan->conn->payload_max),
+                                        produce,
+                                        produce_udata)) == NULL) {
+            /* the content cannot be completed, nor abandoned */
+            if (chan->conn->fd != -1) {
+                (void)shutdown(chan->conn->fd, SHUT_RDWR);
+            }
+            res = CHANNEL_PUBLISH + 28;
+            goto err;
+        }
+    }
+    amqp_conn_stream_end(chan->conn, chan);
+    mnthr_signal_send(&chan->conn->oframe_sig);
+
+    res = channel_publish_confirm(chan, CHANNEL_PUBLISH + 24);
+
+end:
+    if (chan->ostream) {
+        amqp_conn_stream_end(chan->conn, chan);
+        mnthr_signal_send(&chan->conn->oframe_sig);
+    }
+    if (release != NULL) {
+        release(release_udata);
+    }
+    mnthr_sema_release(&chan->sync_sema);
     return res;
+
+err:
+    TR(res);
+    goto end;
 }
 
 
@@ -2088,6 +3819,7 @@ amqp_close_channel_fast(amqp_channel_t *chan)
     (void)hash_traverse(&chan->consumers,
                         (hash_traverser_t)close_consumer_fast_cb, NULL);
     chan->closed = 1;
+    mnthr_cond_signal_all(&chan->confirm_cond);
 }
 
 
@@ -2137,6 +3869,7 @@ amqp_close_channel(amqp_channel_t *chan)
         goto end;
     }
 
+    channel_stop_qos(chan);
     (void)hash_traverse(&chan->consumers,
                         (hash_traverser_t)close_consumer_cb, NULL);
 
@@ -2169,6 +3902,7 @@ amqp_close_channel(amqp_channel_t *chan)
 
 end:
     chan->closed = 1;
+    mnthr_cond_signal_all(&chan->confirm_cond);
     amqp_frame_destroy_method(&fr0);
     return res;
 
@@ -2178,6 +3912,18 @@ err:
 }
 
 
+/*
+ * A channel of weight n gets n times the send quantum per round-robin
+ * turn, against the other channels with frames queued.
+ */
+void
+amqp_channel_set_send_weight(amqp_channel_t *chan, unsigned weight)
+{
+    assert(weight > 0);
+    chan->oweight = weight;
+}
+
+
 void
 amqp_channel_drain_methods(amqp_channel_t *chan)
 {
@@ -2220,8 +3966,34 @@ amqp_consumer_new(amqp_channel_t *chan, uint8_t flags)
     cons->content_cb = NULL;
     cons->cancel_cb = NULL;
     cons->content_udata = NULL;
+    cons->message_cb = NULL;
+    cons->workers = NULL;
+    cons->nworkers = 0;
+    cons->worker_qlen = 0;
+    cons->key_cb = NULL;
+    cons->worker_res = 0;
+    cons->header_cb = NULL;
+    cons->chunk_cb = NULL;
+    cons->stream_pc = NULL;
+    cons->stream_buf = NULL;
+    cons->stream_buf_sz = 0;
+    cons->stream_res = 0;
+    cons->batch_cb = NULL;
+    STQUEUE_INIT(&cons->batch_content);
+    cons->batch = NULL;
+    cons->batch_max = 0;
+    cons->batch_nsec = 0;
+    cons->batch_since = 0;
+    cons->pending_high = 0;
+    cons->pending_low = 0;
+    cons->pending_bytes_high = 0;
+    cons->pending_bytes_low = 0;
+    memset(&cons->flow_stats, 0, sizeof(amqp_consumer_flow_stats_t));
+    cons->throttled_since = 0;
     cons->flags = flags;
     cons->closed = 0;
+    cons->workers_stop = 0;
+    cons->throttled = 0;
 
     return cons;
 }
@@ -2233,126 +4005,710 @@ amqp_consumer_destroy(amqp_consumer_t **cons)
     if (*cons != NULL) {
         amqp_pending_content_t *pc;
 
-        (*cons)->chan = NULL;
         BYTES_DECREF(&(*cons)->consumer_tag);
         if (mnthr_signal_has_owner(&(*cons)->content_sig)) {
             CTRACE("content_sig owner found during consumer destroy: %p",
                    (*cons)->content_sig.owner);
         }
         //assert(!mnthr_signal_has_owner(&(*cons)->content_sig));
+        consumer_unthrottle(*cons);
         while ((pc = STQUEUE_HEAD(&(*cons)->pending_content)) != NULL) {
             STQUEUE_DEQUEUE(&(*cons)->pending_content, link);
             STQUEUE_ENTRY_FINI(link, pc);
             amqp_pending_content_destroy(*cons, &pc);
         }
-        STQUEUE_FINI(&(*cons)->pending_content);
-        free(*cons);
-        *cons = NULL;
+        STQUEUE_FINI(&(*cons)->pending_content);
+        while ((pc = STQUEUE_HEAD(&(*cons)->batch_content)) != NULL) {
+            STQUEUE_DEQUEUE(&(*cons)->batch_content, link);
+            STQUEUE_ENTRY_FINI(link, pc);
+            amqp_pending_content_destroy(*cons, &pc);
+        }
+        STQUEUE_FINI(&(*cons)->batch_content);
+        if ((*cons)->batch != NULL) {
+            free((*cons)->batch);
+        }
+        amqp_pending_content_destroy(*cons, &(*cons)->stream_pc);
+        if ((*cons)->stream_buf != NULL) {
+            free((*cons)->stream_buf);
+        }
+        /* body buffers above are freed through the channel's conn */
+        (*cons)->chan = NULL;
+        free(*cons);
+        *cons = NULL;
+    }
+}
+
+
+static int
+amqp_consumer_item_fini(mnbytes_t *key, amqp_consumer_t *cons)
+{
+    BYTES_DECREF(&key);
+    amqp_consumer_destroy(&cons);
+    return 0;
+}
+
+
+
+static int
+channel_register_consumer(amqp_channel_t *chan, amqp_consumer_t *cons)
+{
+    if (hash_get_item(&chan->consumers, cons->consumer_tag) != NULL) {
+        return 1;
+    }
+    hash_set_item(&chan->consumers, cons->consumer_tag, cons);
+    BYTES_INCREF(cons->consumer_tag);
+    return 0;
+}
+
+
+/*
+ * basic.consume-ok on the receiving thread, see
+ * amqp_channel_create_consumer()
+ */
+static void
+channel_consume_ok(amqp_channel_t *chan, amqp_basic_consume_ok_t *ok)
+{
+    amqp_consumer_t *cons;
+
+    cons = chan->consume_pending;
+    chan->consume_pending = NULL;
+
+    /* transfer consumer_tag reference from ok to cons */
+    assert(ok->consumer_tag != NULL);
+    cons->consumer_tag = ok->consumer_tag;
+    ok->consumer_tag = NULL;
+    if (channel_register_consumer(chan, cons) != 0) {
+        CTRACE("duplicate consumer tag %s", BDATA(cons->consumer_tag));
+    }
+}
+
+
+/*
+ * The consumer is put in chan->consumers by the receiving thread as soon
+ * as basic.consume-ok arrives, deliveries to it may be read next.
+ */
+amqp_consumer_t *
+amqp_channel_create_consumer(amqp_channel_t *chan,
+                             const char *queue,
+                             const char *consumer_tag,
+                             uint8_t flags)
+{
+    mnhash_item_t *dit;
+    amqp_consumer_t *cons;
+    amqp_frame_t *fr0, *fr1;
+    amqp_basic_consume_t *m;
+    mnbytes_t *ctag;
+
+    fr0 = NULL;
+    cons = NULL;
+    ctag = NULL;
+
+    /* the broker would deliver under a tag of its own, unknown here */
+    if ((flags & CONSUME_FNOWAIT) &&
+        (consumer_tag == NULL || *consumer_tag == '\0')) {
+        TR(CHANNEL_CREATE_CONSUMER + 1);
+        goto err;
+    }
+
+    if (mnthr_sema_acquire(&chan->sync_sema) != 0) {
+        TR(CHANNEL_CREATE_CONSUMER + 2);
+        goto err;
+    }
+
+    cons = amqp_consumer_new(chan, flags);
+
+    ctag = bytes_new_from_str(consumer_tag != NULL ? consumer_tag : "");
+    BYTES_INCREF(ctag); //nref = 1
+
+    fr1 = amqp_frame_new(chan->id, AMQP_FMETHOD);
+    m = NEWREF(basic_consume)();
+    assert(queue != NULL);
+    m->queue = bytes_new_from_str(queue);
+    m->consumer_tag = ctag;
+    BYTES_INCREF(m->consumer_tag); //nref = 2
+    m->flags = flags;
+    fr1->payload.params = (amqp_meth_params_t *)m;
+    channel_send_frame(chan, fr1); //nref = 1 (delayed)
+    fr1 = NULL;
+    if (flags & CONSUME_FNOACK) {
+        ++chan->noack_consumers;
+    }
+
+    if (!(flags & CONSUME_FNOWAIT)) {
+        chan->consume_pending = cons;
+        if (channel_expect_method(chan, AMQP_BASIC_CONSUME_OK, &fr0) != 0) {
+            if (chan->consume_pending == cons) {
+                chan->consume_pending = NULL;
+            } else if ((dit = hash_get_item(&chan->consumers,
+                                            cons->consumer_tag)) != NULL &&
+                       dit->value == cons) {
+                /* owned by chan->consumers now */
+                cons = NULL;
+            }
+            mnthr_sema_release(&chan->sync_sema);
+            TR(CHANNEL_CREATE_CONSUMER + 3);
+            goto err;
+        }
+        assert(chan->consume_pending == NULL);
+
+        if ((dit = hash_get_item(&chan->consumers,
+                                 cons->consumer_tag)) == NULL ||
+            dit->value != cons) {
+            mnthr_sema_release(&chan->sync_sema);
+            TR(CHANNEL_CREATE_CONSUMER + 4);
+            goto err;
+        }
+    } else {
+        cons->consumer_tag = ctag;
+        BYTES_INCREF(ctag); //nref = 2
+        if (channel_register_consumer(chan, cons) != 0) {
+            mnthr_sema_release(&chan->sync_sema);
+            TR(CHANNEL_CREATE_CONSUMER + 4);
+            goto err;
+        }
+    }
+
+    mnthr_sema_release(&chan->sync_sema);
+
+end:
+    BYTES_DECREF(&ctag); //nref = 2
+    amqp_frame_destroy_method(&fr0);
+    return cons;
+
+err:
+    amqp_consumer_destroy(&cons);
+    goto end;
+}
+
+
+amqp_consumer_t *
+amqp_channel_set_default_consumer(amqp_channel_t *chan)
+{
+    if (chan->default_consumer == NULL) {
+        chan->default_consumer = amqp_consumer_new(chan, 0);
+        chan->default_consumer->consumer_tag = bytes_new_from_str("amqdcns");
+        BYTES_INCREF(chan->default_consumer->consumer_tag);
+    }
+    return chan->default_consumer;
+}
+
+
+/*
+ * Budget for deliveries received but not yet taken by the content
+ * thread: once a complete delivery brings them to high messages or
+ * bytes_high octets, the connection stops reading until they are back
+ * to low messages and bytes_low octets.  Zero high is no limit.  While a
+ * handler or any other thread waits for the broker on this connection,
+ * a sync method, a publish confirm or an RPC reply, the connection keeps
+ * reading past the budget.
+ */
+void
+amqp_consumer_set_pending_limits(amqp_consumer_t *cons,
+                                 size_t high,
+                                 size_t low,
+                                 size_t bytes_high,
+                                 size_t bytes_low)
+{
+    assert(high == 0 || low < high);
+    assert(bytes_high == 0 || bytes_low < bytes_high);
+    cons->pending_high = high;
+    cons->pending_low = high > 0 ? low : SIZE_MAX;
+    cons->pending_bytes_high = bytes_high;
+    cons->pending_bytes_low = bytes_high > 0 ? bytes_low : SIZE_MAX;
+    if (cons->throttled && !consumer_over_budget(cons)) {
+        consumer_unthrottle(cons);
+    }
+}
+
+
+void
+amqp_consumer_get_flow_stats(amqp_consumer_t *cons,
+                             amqp_consumer_flow_stats_t *stats)
+{
+    *stats = cons->flow_stats;
+    if (cons->throttled) {
+        stats->throttled_nsec += mnthr_get_now_nsec() - cons->throttled_since;
+    }
+}
+
+
+/*
+ * Hold basic.acks of the channel until nmsg deliveries are acked, or usec
+ * after the oldest held ack, whichever comes first, and send them as one
+ * multiple basic.ack.  Zero usec means no deadline, nmsg below 2 and zero
+ * usec turn holding off.  Acks past an unsettled delivery wait for it, and
+ * go out one by one at the deadline, or right away with holding off.
+ */
+void
+amqp_consumer_set_ack_batch(amqp_consumer_t *cons, size_t nmsg, uint64_t usec)
+{
+    cons->chan->ack_batch = nmsg;
+    cons->chan->ack_batch_nsec = usec * 1000;
+}
+
+
+/*
+ * Acknowledgement counters of the consumer's channel.
+ */
+void
+amqp_consumer_get_ack_stats(amqp_consumer_t *cons,
+                            amqp_consumer_ack_stats_t *stats)
+{
+    *stats = cons->chan->ack_stats;
+    stats->ack_frames_saved = stats->acked - stats->ack_frames;
+}
+
+
+static void
+channel_send_ack_cb(uint64_t delivery_tag, size_t n, void *udata)
+{
+    amqp_channel_t *chan;
+    amqp_frame_t *fr;
+    amqp_basic_ack_t *m;
+
+    chan = udata;
+    fr = amqp_frame_new(chan->id, AMQP_FMETHOD);
+    m = NEWREF(basic_ack)();
+    m->delivery_tag = delivery_tag;
+    m->flags = n > 1 ? ACK_MULTIPLE : 0;
+    fr->payload.params = (amqp_meth_params_t *)m;
+    channel_send_frame(chan, fr);
+    ++chan->ack_stats.ack_frames;
+}
+
+
+static void
+channel_flush_acks(amqp_channel_t *chan, int flush)
+{
+    (void)amqp_delivery_tracker_collect(&chan->deliveries,
+                                        flush,
+                                        channel_send_ack_cb,
+                                        chan);
+}
+
+
+static void
+channel_acks_due(amqp_channel_t *chan)
+{
+    amqp_delivery_tracker_t *tr;
+
+    tr = &chan->deliveries;
+    if (chan->ack_batch < 2 && chan->ack_batch_nsec == 0) {
+        /* nothing is held, not even acks past an unsettled delivery */
+        channel_flush_acks(chan, 1);
+
+    } else if (chan->ack_batch_nsec > 0 &&
+               tr->nready > 0 &&
+               mnthr_get_now_nsec() - tr->ready_since >=
+                    chan->ack_batch_nsec) {
+        channel_flush_acks(chan, 1);
+
+    } else if (chan->ack_batch >= 2 && tr->nready >= chan->ack_batch) {
+        channel_flush_acks(chan, 0);
+    }
+}
+
+
+/*
+ * Mark a delivery acked, its basic.ack goes out with channel_acks_due().
+ */
+static int
+consumer_ack_hold(amqp_consumer_t *cons, uint64_t delivery_tag)
+{
+    amqp_channel_t *chan;
+
+    chan = cons->chan;
+    if (chan->closed) {
+        TRRET(CONSUMER_ACK + 1);
+    }
+    if (amqp_delivery_tracker_ack(&chan->deliveries,
+                                  delivery_tag,
+                                  mnthr_get_now_nsec()) != 0) {
+        TRRET(CONSUMER_ACK + 2);
+    }
+    ++chan->ack_stats.acked;
+    return 0;
+}
+
+
+/*
+ * Acknowledge a delivery on the consumer's channel.  Deliveries may be
+ * acked in any order, see amqp_consumer_set_ack_batch() to send acks of
+ * contiguous deliveries as one multiple basic.ack.  Return non-zero if the
+ * delivery is unknown or already settled.
+ */
+int
+amqp_consumer_ack(amqp_consumer_t *cons, uint64_t delivery_tag)
+{
+    int res;
+
+    if ((res = consumer_ack_hold(cons, delivery_tag)) != 0) {
+        return res;
+    }
+    channel_acks_due(cons->chan);
+    return 0;
+}
+
+
+static int
+consumer_settle(amqp_consumer_t *cons,
+                uint64_t delivery_tag,
+                amqp_meth_params_t *params,
+                int errid)
+{
+    amqp_channel_t *chan;
+    amqp_frame_t *fr;
+
+    chan = cons->chan;
+    if (chan->closed ||
+        !amqp_delivery_tracker_unsettled(&chan->deliveries, delivery_tag)) {
+        amqp_meth_params_destroy(&params);
+        TRRET(errid);
+    }
+
+    /* acks due so far, a multiple ack must not cover this delivery */
+    channel_flush_acks(chan, 0);
+
+    fr = amqp_frame_new(chan->id, AMQP_FMETHOD);
+    fr->payload.params = params;
+    channel_send_frame(chan, fr);
+    (void)amqp_delivery_tracker_settle(&chan->deliveries, delivery_tag);
+    ++chan->ack_stats.nacked;
+
+    /* this delivery may have been the one holding back later acks */
+    channel_acks_due(chan);
+    return 0;
+}
+
+
+/*
+ * Reject a delivery with basic.nack, or basic.reject below.
+ */
+int
+amqp_consumer_nack(amqp_consumer_t *cons, uint64_t delivery_tag, int requeue)
+{
+    amqp_basic_nack_t *m;
+
+    m = NEWREF(basic_nack)();
+    m->delivery_tag = delivery_tag;
+    m->flags = requeue ? NACK_REQUEUE : 0;
+    return consumer_settle(cons,
+                           delivery_tag,
+                           (amqp_meth_params_t *)m,
+                           CONSUMER_ACK + 3);
+}
+
+
+int
+amqp_consumer_reject(amqp_consumer_t *cons,
+                     uint64_t delivery_tag,
+                     int requeue)
+{
+    amqp_basic_reject_t *m;
+
+    m = NEWREF(basic_reject)();
+    m->delivery_tag = delivery_tag;
+    m->flags = requeue ? REJECT_REQUEUE : 0;
+    return consumer_settle(cons,
+                           delivery_tag,
+                           (amqp_meth_params_t *)m,
+                           CONSUMER_ACK + 4);
+}
+
+
+/*
+ * Wait for more content, but no longer than the held acks' deadline, or
+ * the batch's, which content_thread_worker() then delivers.
+ */
+static int
+consumer_wait_content(amqp_consumer_t *cons)
+{
+    int res;
+    amqp_channel_t *chan;
+    uint64_t now, deadline, ack_deadline;
+
+    chan = cons->chan;
+    deadline = 0;
+    ack_deadline = 0;
+    if (chan->deliveries.nready > 0 && chan->ack_batch_nsec > 0) {
+        ack_deadline = chan->deliveries.ready_since + chan->ack_batch_nsec;
+        deadline = ack_deadline;
+    }
+    if (!STQUEUE_EMPTY(&cons->batch_content)) {
+        uint64_t batch_deadline;
+
+        batch_deadline = cons->batch_since + cons->batch_nsec;
+        if (deadline == 0 || batch_deadline < deadline) {
+            deadline = batch_deadline;
+        }
+    }
+    if (deadline == 0) {
+        return mnthr_signal_subscribe(&cons->content_sig);
+    }
+
+    now = mnthr_get_now_nsec();
+    if (now < deadline) {
+        res = mnthr_signal_subscribe_with_timeout(&cons->content_sig,
+                                                  (deadline - now + 999999) /
+                                                    1000000);
+        if (res != (int)MNTHR_WAIT_TIMEOUT) {
+            return res;
+        }
+        now = mnthr_get_now_nsec();
     }
+    if (ack_deadline > 0 && now >= ack_deadline) {
+        channel_flush_acks(chan, 1);
+    }
+    return 0;
 }
 
 
 static int
-amqp_consumer_item_fini(mnbytes_t *key, amqp_consumer_t *cons)
+consumer_batch_due(amqp_consumer_t *cons)
 {
-    BYTES_DECREF(&key);
-    amqp_consumer_destroy(&cons);
-    return 0;
+    return !STQUEUE_EMPTY(&cons->batch_content) &&
+           mnthr_get_now_nsec() - cons->batch_since >= cons->batch_nsec;
 }
 
 
-
-amqp_consumer_t *
-amqp_channel_create_consumer(amqp_channel_t *chan,
-                             const char *queue,
-                             const char *consumer_tag,
-                             uint8_t flags)
+/*
+ * Pass the batch to batch_cb.  A MNAMQP_CONSUME_NACK or
+ * MNAMQP_CONSUME_DEFER return settles the whole batch, 0 leaves it to
+ * each delivery's res.  The batch's acks are sent together, contiguous
+ * ones as a single multiple basic.ack.
+ */
+static int
+consumer_deliver_batch(amqp_consumer_t *cons)
 {
-    mnhash_item_t *dit;
-    amqp_consumer_t *cons;
-    amqp_frame_t *fr0, *fr1;
-    amqp_basic_consume_t *m;
-    amqp_basic_consume_ok_t *ok;
-    mnbytes_t *ctag;
+    int res;
+    size_t i, n;
+    uint64_t start;
+    amqp_pending_content_t *pc;
 
-    fr0 = NULL;
-    cons = NULL;
-    ctag = NULL;
+    n = 0;
+    for (pc = STQUEUE_HEAD(&cons->batch_content);
+         pc != NULL;
+         pc = STQUEUE_NEXT(link, pc)) {
+        amqp_delivery_t *d;
+
+        d = &cons->batch[n++];
+        d->method = pc->method;
+        d->header = pc->header;
+        d->data = pc->data;
+        pc->data = NULL; /* passed over to batch_cb() */
+        if (d->data != NULL) {
+            amqp_conn_buffer_passed(cons->chan->conn,
+                                    pc->header->payload.header->body_size);
+        }
+        d->res = 0;
+    }
 
-    if ((flags & CONSUME_FNOWAIT) &&
-        (consumer_tag == NULL || *consumer_tag == '\0')) {
-        TR(CHANNEL_CREATE_CONSUMER + 1);
-        goto err;
+    start = mnthr_get_now_nsec();
+    res = cons->batch_cb(cons->batch, n, cons->content_udata);
+    channel_qos_handled(cons->chan, start, n);
+
+    for (i = 0; !(cons->flags & CONSUME_FNOACK) && i < n; ++i) {
+        amqp_basic_deliver_t *m;
+        int dres;
+
+        m = (amqp_basic_deliver_t *)cons->batch[i].method->payload.params;
+        dres = res != 0 ? res : cons->batch[i].res;
+        if (dres == MNAMQP_CONSUME_NACK) {
+            (void)amqp_consumer_nack(cons, m->delivery_tag, 0);
+        } else if (dres != MNAMQP_CONSUME_DEFER) {
+            (void)consumer_ack_hold(cons, m->delivery_tag);
+        }
+    }
+    if (!cons->chan->closed) {
+        channel_acks_due(cons->chan);
+    }
+    if (res == MNAMQP_CONSUME_NACK || res == MNAMQP_CONSUME_DEFER) {
+        res = 0;
     }
 
-    if (mnthr_sema_acquire(&chan->sync_sema) != 0) {
-        TR(CHANNEL_CREATE_CONSUMER + 2);
-        goto err;
+    while ((pc = STQUEUE_HEAD(&cons->batch_content)) != NULL) {
+        STQUEUE_DEQUEUE(&cons->batch_content, link);
+        STQUEUE_ENTRY_FINI(link, pc);
+        amqp_pending_content_destroy(cons, &pc);
     }
+    return res;
+}
 
-    cons = amqp_consumer_new(chan, flags);
 
-    ctag = bytes_new_from_str(consumer_tag != NULL ? consumer_tag : "");
-    BYTES_INCREF(ctag); //nref = 1
+/*
+ * Pass a complete delivery to content_cb and settle it as content_cb
+ * says.
+ */
+static int
+consumer_deliver(amqp_consumer_t *cons, amqp_pending_content_t *pc)
+{
+    int res;
+    char *data;
+    uint64_t start;
+    amqp_frame_t *method;
+    amqp_message_t *msg;
+
+    /* filled in by the receiving thread */
+    data = pc->data;
+    pc->data = NULL;
+    if (data != NULL) {
+        amqp_conn_buffer_passed(cons->chan->conn,
+                                pc->header->payload.header->body_size);
+    }
 
-    fr1 = amqp_frame_new(chan->id, AMQP_FMETHOD);
-    m = NEWREF(basic_consume)();
-    assert(queue != NULL);
-    m->queue = bytes_new_from_str(queue);
-    m->consumer_tag = ctag;
-    BYTES_INCREF(m->consumer_tag); //nref = 2
-    m->flags = flags;
-    fr1->payload.params = (amqp_meth_params_t *)m;
-    channel_send_frame(chan, fr1); //nref = 1 (delayed)
-    fr1 = NULL;
+    msg = NULL;
+    start = mnthr_get_now_nsec();
+    if (cons->message_cb != NULL) {
+        /* the message takes the frames and the body over */
+        msg = amqp_message_new(pc->method,
+                               pc->header,
+                               data,
+                               cons->chan->conn->buffer_free);
+        pc->method = NULL;
+        pc->header = NULL;
+        res = cons->message_cb(msg, cons->content_udata);
+        method = msg->method;
+    } else {
+        assert(cons->content_cb != NULL);
+        res = cons->content_cb(pc->method,
+                               pc->header,
+                               data,
+                               cons->content_udata);
+        method = pc->method;
+    }
+    data = NULL; /* passed over to content_cb() */
+    channel_qos_handled(cons->chan, start, 1);
 
-    if (!(flags & CONSUME_FNOWAIT)) {
-        if (channel_expect_method(chan, AMQP_BASIC_CONSUME_OK, &fr0) != 0) {
-            mnthr_sema_release(&chan->sync_sema);
-            TR(CHANNEL_CREATE_CONSUMER + 3);
-            goto err;
-        }
+    if (res == MNAMQP_CONSUME_DEFER) {
+        res = 0;
 
-        /* transfer consumer_tag reference from ok to cons */
-        ok = (amqp_basic_consume_ok_t *)fr0->payload.params;
-        assert(ok->consumer_tag != NULL);
-        cons->consumer_tag = ok->consumer_tag;
-        ok->consumer_tag = NULL;
-    } else {
-        cons->consumer_tag = ctag;
-        BYTES_INCREF(ctag); //nref = 2
+    } else if (!(cons->flags & CONSUME_FNOACK)) {
+        amqp_basic_deliver_t *d;
+
+        d = (amqp_basic_deliver_t *)method->payload.params;
+        if (res == MNAMQP_CONSUME_NACK) {
+            (void)amqp_consumer_nack(cons, d->delivery_tag, 0);
+            res = 0;
+        } else {
+            (void)amqp_consumer_ack(cons, d->delivery_tag);
+        }
     }
 
-    if ((dit = hash_get_item(&chan->consumers, cons->consumer_tag)) != NULL) {
-        mnthr_sema_release(&chan->sync_sema);
-        TR(CHANNEL_CREATE_CONSUMER + 4);
-        goto err;
+    /* handlers that kept the message have retained it */
+    amqp_message_release(&msg);
+    return res;
+}
+
+
+/*
+ * A delivery buffered whole before the consumer turned to streaming: pass
+ * it to header_cb and chunk_cb in one piece, content_cb follows.
+ */
+static void
+consumer_stream_buffered(amqp_consumer_t *cons, amqp_pending_content_t *pc)
+{
+    amqp_header_t *header;
+
+    header = pc->header->payload.header;
+    if ((cons->header_cb == NULL ||
+         cons->header_cb(pc->method, pc->header, cons->content_udata) == 0) &&
+        header->body_size > 0) {
+        (void)cons->chunk_cb(pc->method,
+                             pc->data,
+                             header->body_size,
+                             cons->content_udata);
     }
-    hash_set_item(&chan->consumers, cons->consumer_tag, cons);
-    BYTES_INCREF(cons->consumer_tag); //nref = 3
+    if (pc->data != NULL) {
+        amqp_conn_buffer_free(cons->chan->conn, pc->data, header->body_size);
+        pc->data = NULL;
+    }
+}
 
-    mnthr_sema_release(&chan->sync_sema);
 
-end:
-    BYTES_DECREF(&ctag); //nref = 2
-    amqp_frame_destroy_method(&fr0);
-    return cons;
+/*
+ * worker pool
+ */
+static int
+consumer_worker(UNUSED int argc, void **argv)
+{
+    amqp_consumer_worker_t *w;
+    amqp_consumer_t *cons;
 
-err:
-    amqp_consumer_destroy(&cons);
-    goto end;
+    assert(argc == 1);
+    w = argv[0];
+    cons = w->cons;
+
+    while (1) {
+        amqp_pending_content_t *pc;
+        int res;
+
+        if ((pc = STQUEUE_HEAD(&w->queue)) == NULL) {
+            if (cons->workers_stop) {
+                break;
+            }
+            if (mnthr_cond_wait(&w->cond) != 0) {
+                break;
+            }
+            continue;
+        }
+        STQUEUE_DEQUEUE(&w->queue, link);
+        STQUEUE_ENTRY_FINI(link, pc);
+        mnthr_cond_signal_all(&cons->worker_room);
+
+        res = consumer_deliver(cons, pc);
+        amqp_pending_content_destroy(cons, &pc);
+
+        if (res != 0 && cons->worker_res == 0) {
+            /* stop the dispatcher, as a failing content_cb would */
+            cons->worker_res = res;
+            cons->closed = 1;
+            mnthr_signal_send(&cons->content_sig);
+            mnthr_cond_signal_all(&cons->worker_room);
+        }
+    }
+
+    MNTHRET(0);
 }
 
 
-amqp_consumer_t *
-amqp_channel_set_default_consumer(amqp_channel_t *chan)
+/*
+ * Queue a complete delivery to the worker for its key, or to the least
+ * loaded one.  Wait while the worker's queue is full.
+ */
+static int
+consumer_dispatch(amqp_consumer_t *cons, amqp_pending_content_t *pc)
 {
-    if (chan->default_consumer == NULL) {
-        chan->default_consumer = amqp_consumer_new(chan, 0);
-        chan->default_consumer->consumer_tag = bytes_new_from_str("amqdcns");
-        BYTES_INCREF(chan->default_consumer->consumer_tag);
+    amqp_consumer_worker_t *w;
+
+    if (cons->key_cb != NULL) {
+        w = &cons->workers[cons->key_cb(pc->method,
+                                        pc->header,
+                                        cons->content_udata) %
+                           cons->nworkers];
+    } else {
+        size_t i;
+
+        w = &cons->workers[0];
+        for (i = 1; i < cons->nworkers; ++i) {
+            if (STQUEUE_LENGTH(&cons->workers[i].queue) <
+                STQUEUE_LENGTH(&w->queue)) {
+                w = &cons->workers[i];
+            }
+        }
     }
-    return chan->default_consumer;
+
+    while (STQUEUE_LENGTH(&w->queue) >= cons->worker_qlen) {
+        if (mnthr_cond_wait(&cons->worker_room) != 0) {
+            TRRET(CONTENT_THREAD_WORKER + 4);
+        }
+        if (cons->closed) {
+            TRRET(CONTENT_THREAD_WORKER + 5);
+        }
+    }
+
+    STQUEUE_ENQUEUE(&w->queue, link, pc);
+    mnthr_cond_signal_one(&w->cond);
+    return 0;
 }
 
 
@@ -2375,10 +4731,16 @@ content_thread_worker(UNUSED int argc, void **argv)
     //CTRACE("consumer %s listening ...", BDATA(cons->consumer_tag));
     while (!cons->closed) {
         amqp_pending_content_t *pc;
-        char *data;
 
         if ((pc = STQUEUE_HEAD(&cons->pending_content)) == NULL) {
-            if (mnthr_signal_subscribe(&cons->content_sig) != 0) {
+            if (consumer_batch_due(cons)) {
+                if ((res = consumer_deliver_batch(cons)) != 0) {
+                    TR(res);
+                    break;
+                }
+                continue;
+            }
+            if (consumer_wait_content(cons) != 0) {
                 res = CONTENT_THREAD_WORKER + 1;
                 TR(res);
                 goto err;
@@ -2392,90 +4754,68 @@ content_thread_worker(UNUSED int argc, void **argv)
              * XXX content_cb ?
              */
 
-            if (pc->header == NULL) {
-                if (mnthr_signal_subscribe(&cons->content_sig) != 0) {
+            if (pc->header == NULL ||
+                pc->header->payload.header->_received_size <
+                    pc->header->payload.header->body_size) {
+                if (consumer_batch_due(cons)) {
+                    if ((res = consumer_deliver_batch(cons)) != 0) {
+                        TR(res);
+                        break;
+                    }
+                    continue;
+                }
+                if (consumer_wait_content(cons) != 0) {
                     res = CONTENT_THREAD_WORKER + 2;
                     TR(res);
                     goto err;
                 }
                 continue;
             }
-            /*
-             * XXX content_cb ?
-             */
 
-            if ((data = cons->chan->conn->buffer_alloc(
-                    pc->header->payload.header->body_size)) == NULL) {
-                FAIL("buffer_alloc");
-            }
+            STQUEUE_DEQUEUE(&cons->pending_content, link);
+            STQUEUE_ENTRY_FINI(link, pc);
+            consumer_content_taken(cons, pc);
 
-            while (pc->header->payload.header->body_size >
-                   pc->header->payload.header->_received_size) {
-                size_t sz0;
-                amqp_frame_t *fr;
+            if (cons->workers != NULL) {
+                /* pc is taken over by a worker */
+                if ((res = consumer_dispatch(cons, pc)) != 0) {
+                    amqp_pending_content_destroy(cons, &pc);
+                    TR(res);
+                    break;
+                }
 
-                if ((fr = STQUEUE_HEAD(&pc->body)) == NULL) {
-                    if (mnthr_signal_subscribe(&cons->content_sig) != 0) {
-                        res = CONTENT_THREAD_WORKER + 3;
+            } else if (cons->batch_cb != NULL) {
+                if (STQUEUE_EMPTY(&cons->batch_content)) {
+                    cons->batch_since = mnthr_get_now_nsec();
+                }
+                STQUEUE_ENQUEUE(&cons->batch_content, link, pc);
+                if (STQUEUE_LENGTH(&cons->batch_content) >= cons->batch_max) {
+                    if ((res = consumer_deliver_batch(cons)) != 0) {
                         TR(res);
-                        goto err;
+                        break;
                     }
-                    continue;
                 }
-                sz0 = pc->header->payload.header->_received_size;
-                memcpy(data + sz0, fr->payload.body, fr->sz);
-                pc->header->payload.header->_received_size += fr->sz;
-                STQUEUE_DEQUEUE(&pc->body, link);
-                STQUEUE_ENTRY_FINI(link, fr);
-                amqp_frame_destroy(cons->chan->conn, &fr);
-                /*
-                 * XXX content_cb ?
-                 */
-            }
-
-            assert(cons->content_cb != NULL);
-            res = cons->content_cb(pc->method,
-                                   pc->header,
-                                   data,
-                                   cons->content_udata);
-            data = NULL; /* passed over to content_cb() */
-
-            if (!(cons->flags & CONSUME_FNOACK)) {
-                amqp_frame_t *fr1;
-                amqp_basic_deliver_t *d;
-
-                if (res == MNAMQP_CONSUME_NACK) {
-                    amqp_basic_nack_t *m;
-                    fr1 = amqp_frame_new(cons->chan->id, AMQP_FMETHOD);
-                    m = NEWREF(basic_nack)();
-                    d = (amqp_basic_deliver_t *)pc->method->payload.params;
-                    m->delivery_tag = d->delivery_tag;
-                    fr1->payload.params = (amqp_meth_params_t *)m;
-                    res = 0;
 
-                } else {
-                    amqp_basic_ack_t *m;
-                    fr1 = amqp_frame_new(cons->chan->id, AMQP_FMETHOD);
-                    m = NEWREF(basic_ack)();
-                    d = (amqp_basic_deliver_t *)pc->method->payload.params;
-                    m->delivery_tag = d->delivery_tag;
-                    fr1->payload.params = (amqp_meth_params_t *)m;
+            } else {
+                if (cons->chunk_cb != NULL) {
+                    consumer_stream_buffered(cons, pc);
+                }
+                res = consumer_deliver(cons, pc);
+                amqp_pending_content_destroy(cons, &pc);
+                if (res != 0) {
+                    TR(res);
+                    break;
                 }
-
-                channel_send_frame(cons->chan, fr1);
-                fr1 = NULL;
-            }
-
-            STQUEUE_DEQUEUE(&cons->pending_content, link);
-            STQUEUE_ENTRY_FINI(link, pc);
-            amqp_pending_content_destroy(cons, &pc);
-
-            if (res != 0) {
-                TR(res);
-                break;
             }
 
         } else if (pc->method->payload.params->mi->mid == AMQP_BASIC_CANCEL) {
+            if (!STQUEUE_EMPTY(&cons->batch_content)) {
+                /* what came before the cancel goes first */
+                if ((res = consumer_deliver_batch(cons)) != 0) {
+                    TR(res);
+                    break;
+                }
+            }
             if (cons->cancel_cb != NULL) {
                 res = cons->cancel_cb(pc->method,
                                       pc->header,
@@ -2499,6 +4839,9 @@ content_thread_worker(UNUSED int argc, void **argv)
     }
 
 end:
+    if (cons->chan != NULL && !cons->chan->closed) {
+        channel_flush_acks(cons->chan, 1);
+    }
     mnthr_signal_fini(&cons->content_sig);
     MNTHRET(res);
 
@@ -2525,6 +4868,83 @@ amqp_consumer_handle_content_spawn(amqp_consumer_t *cons,
 }
 
 
+/*
+ * Like amqp_consumer_handle_content(), but run content_cb in nworkers
+ * threads, each taking up to qlen deliveries.  If key_cb is given,
+ * deliveries with equal key_cb(method, header, udata) go to the same
+ * worker and are handled in order.  Acks of deliveries completing out of
+ * order go out one by one, unless held by amqp_consumer_set_ack_batch()
+ * until earlier ones are settled or the deadline.
+ */
+int
+amqp_consumer_handle_content_pool(amqp_consumer_t *cons,
+                                  size_t nworkers,
+                                  size_t qlen,
+                                  amqp_consumer_key_cb_t key_cb,
+                                  amqp_consumer_content_cb_t ctcb,
+                                  amqp_consumer_content_cb_t clcb,
+                                  void *udata)
+{
+    int res;
+    size_t i;
+    amqp_consumer_t **p = &cons;
+
+    assert(nworkers > 0 && qlen > 0);
+    cons->content_cb = ctcb;
+    cons->cancel_cb = clcb;
+    cons->content_udata = udata;
+    cons->key_cb = key_cb;
+    cons->worker_qlen = qlen;
+    cons->worker_res = 0;
+    cons->workers_stop = 0;
+    mnthr_cond_init(&cons->worker_room);
+    if ((cons->workers = malloc(
+            sizeof(amqp_consumer_worker_t) * nworkers)) == NULL) {
+        FAIL("malloc");
+    }
+    cons->nworkers = nworkers;
+    for (i = 0; i < nworkers; ++i) {
+        amqp_consumer_worker_t *w;
+
+        w = &cons->workers[i];
+        w->cons = cons;
+        STQUEUE_INIT(&w->queue);
+        mnthr_cond_init(&w->cond);
+        w->thread = MNTHR_SPAWN(BCDATA(cons->consumer_tag),
+                                consumer_worker,
+                                w);
+    }
+
+    res = content_thread_worker(1, (void **)p);
+
+    /* let workers finish what they have taken */
+    cons->workers_stop = 1;
+    for (i = 0; i < nworkers; ++i) {
+        mnthr_cond_signal_one(&cons->workers[i].cond);
+    }
+    for (i = 0; i < nworkers; ++i) {
+        amqp_consumer_worker_t *w;
+
+        w = &cons->workers[i];
+        (void)mnthr_join(w->thread);
+        assert(STQUEUE_HEAD(&w->queue) == NULL);
+        mnthr_cond_fini(&w->cond);
+    }
+    if (!cons->chan->closed) {
+        channel_flush_acks(cons->chan, 1);
+    }
+    free(cons->workers);
+    cons->workers = NULL;
+    cons->nworkers = 0;
+    mnthr_cond_fini(&cons->worker_room);
+
+    if (res == 0) {
+        res = cons->worker_res;
+    }
+    return res;
+}
+
+
 int
 amqp_consumer_handle_content(amqp_consumer_t *cons,
                              amqp_consumer_content_cb_t ctcb,
@@ -2539,11 +4959,115 @@ amqp_consumer_handle_content(amqp_consumer_t *cons,
 }
 
 
+/*
+ * Like amqp_consumer_handle_content(), but pass each delivery to
+ * msgcb(msg, udata) as an amqp_message_t.  The message is released when
+ * msgcb returns, amqp_message_retain() it to pass it on to other
+ * handlers or to amqp_channel_publish_message().  msgcb returns as
+ * content_cb would.
+ */
+int
+amqp_consumer_handle_messages(amqp_consumer_t *cons,
+                              amqp_consumer_message_cb_t msgcb,
+                              amqp_consumer_content_cb_t clcb,
+                              void *udata)
+{
+    amqp_consumer_t **p = &cons;
+
+    assert(msgcb != NULL);
+    cons->message_cb = msgcb;
+    cons->cancel_cb = clcb;
+    cons->content_udata = udata;
+    return content_thread_worker(1, (void **)p);
+}
+
+
+/*
+ * Like amqp_consumer_handle_content(), but pass deliveries to
+ * batch_cb(deliveries, n, udata) nmsg at a time, or fewer once usec have
+ * passed since the first of them.  See consumer_deliver_batch() for how
+ * they are settled.
+ */
+int
+amqp_consumer_handle_content_batch(amqp_consumer_t *cons,
+                                   size_t nmsg,
+                                   uint64_t usec,
+                                   amqp_consumer_batch_cb_t btcb,
+                                   amqp_consumer_content_cb_t clcb,
+                                   void *udata)
+{
+    amqp_consumer_t **p = &cons;
+
+    assert(nmsg > 0);
+    assert(btcb != NULL);
+    if (cons->batch_max < nmsg) {
+        if ((cons->batch = realloc(cons->batch,
+                                   nmsg * sizeof(amqp_delivery_t))) == NULL) {
+            FAIL("realloc");
+        }
+    }
+    cons->batch_max = nmsg;
+    cons->batch_nsec = usec * 1000;
+    cons->batch_cb = btcb;
+    cons->cancel_cb = clcb;
+    cons->content_udata = udata;
+    return content_thread_worker(1, (void **)p);
+}
+
+
+/*
+ * Like amqp_consumer_handle_content(), but without buffering bodies:
+ * header_cb(method, header, udata) is called once the content header is
+ * in, chunk_cb(method, data, sz, udata) for each body frame, and then
+ * ctcb(method, header, NULL, udata) settles the delivery as it would in
+ * amqp_consumer_handle_content().  Non-zero from header_cb or chunk_cb
+ * skips the rest of the chunks.  data is valid for the call only, and
+ * memory per delivery stays within frame_max.  All three callbacks run on
+ * the connection's receiving thread: no frame of any channel is read
+ * while they run, so they must not block, and must not wait for a reply
+ * from the broker on this connection.
+ */
+int
+amqp_consumer_handle_content_stream(amqp_consumer_t *cons,
+                                    amqp_consumer_header_cb_t hdcb,
+                                    amqp_consumer_chunk_cb_t chcb,
+                                    amqp_consumer_content_cb_t ctcb,
+                                    amqp_consumer_content_cb_t clcb,
+                                    void *udata)
+{
+    int res;
+    amqp_consumer_t **p = &cons;
+
+    assert(chcb != NULL);
+    assert(ctcb != NULL);
+    if (cons->stream_buf == NULL && cons->chan->conn->frame_max > 0) {
+        if ((cons->stream_buf = malloc(cons->chan->conn->frame_max)) == NULL) {
+            FAIL("malloc");
+        }
+        cons->stream_buf_sz = cons->chan->conn->frame_max;
+    }
+    cons->header_cb = hdcb;
+    cons->content_cb = ctcb;
+    cons->cancel_cb = clcb;
+    cons->content_udata = udata;
+    cons->stream_res = 0;
+    /* the receiving thread streams from now on */
+    cons->chunk_cb = chcb;
+
+    res = content_thread_worker(1, (void **)p);
+    if (res == 0) {
+        res = cons->stream_res;
+    }
+    return res;
+}
+
+
 void
 amqp_close_consumer_fast(amqp_consumer_t *cons)
 {
     if (!cons->closed) {
         cons->closed = 1;
+        consumer_unthrottle(cons);
     }
 }
 
@@ -2553,6 +5077,8 @@ amqp_close_consumer(amqp_consumer_t *cons)
 {
     if (!cons->closed) {
         cons->closed = 1;
+        /* basic.cancel-ok has to be read */
+        consumer_unthrottle(cons);
         assert(cons->consumer_tag != NULL);
         if (amqp_channel_cancel(cons->chan,
                                 BCDATA(cons->consumer_tag),
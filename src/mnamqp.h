@@ -1,6 +1,8 @@
 #ifndef MNAMQP_H_DEFINED
 #define MNAMQP_H_DEFINED
 
+#include <sys/uio.h>
+
 #include <mncommon/array.h>
 #include <mncommon/bytes.h>
 #include <mncommon/bytestream.h>
@@ -20,6 +22,46 @@ extern "C" {
 struct _amqp_channel;
 struct _amqp_consumer;
 
+typedef struct _amqp_conn_stats {
+    /* frames written out */
+    uint64_t oframes;
+    /* writes of the output buffer, oframes / oflushes is frames per flush */
+    uint64_t oflushes;
+    /* frames and their octets queued for the send thread right now */
+    size_t oqueued_frames;
+    size_t oqueued_bytes;
+    /* publishes that had to wait for the queue to drain */
+    uint64_t oblocks;
+    /* frames that went out through the control lane */
+    uint64_t ocontrol;
+    /* body buffers held for this connection, see mnamqp_set_memory_cap() */
+    size_t mem_live;
+    size_t mem_peak;
+} amqp_conn_stats_t;
+
+
+typedef struct _amqp_memory_stats {
+    /* octets, see mnamqp_set_memory_cap() */
+    size_t cap;
+    size_t live;
+    size_t peak;
+    /* the part of live queued to be sent */
+    size_t out;
+} amqp_memory_stats_t;
+
+
+/*
+ * object pool counters, hits / (hits + misses) is the reuse rate
+ */
+typedef struct _amqp_pool_stats {
+    uint64_t hits;
+    uint64_t misses;
+    /* objects cached for reuse */
+    size_t nfree;
+} amqp_pool_stats_t;
+
+struct _amqp_slab;
+
 typedef struct _amqp_conn {
     char *host;
     int port;
@@ -39,28 +81,134 @@ typedef struct _amqp_conn {
     mnthr_ctx_t *send_thread;
     mnthr_ctx_t *heartbeat_thread;
     uint64_t last_sock_op;
-    /* outgoing frames */
-    STQUEUE(_amqp_frame, oframes);
+    /*
+     * channels with outgoing frames queued, served in deficit round-robin
+     * order, see amqp_channel_set_send_weight()
+     */
+    DTQUEUE(_amqp_channel, ochannels);
+    size_t oframes;
+    /*
+     * outgoing heartbeats and methods of channels with no frames queued,
+     * sent ahead of the channels' frames
+     */
+    STQUEUE(_amqp_frame, ocontrol);
+    size_t oframes_bytes;
     mnthr_signal_t oframe_sig;
+    /* publisher backpressure, see amqp_conn_set_send_watermarks() */
+    size_t send_high;
+    size_t send_low;
+    mnthr_cond_t send_room;
+    /* streamed publishes, see amqp_channel_publish_stream() */
+    mnthr_cond_t stream_room;
+    /*
+     * consumers over their pending budget, the receiving thread stops
+     * reading while there are any, see amqp_consumer_set_pending_limits(),
+     * unless some thread is waiting for the broker, see
+     * amqp_conn_recv_wait_begin()
+     */
+    size_t recv_throttled;
+    size_t recv_waiters;
+    mnthr_cond_t recv_room;
     mnthr_signal_t ping_sig;
+    /* send batching limits, see amqp_conn_set_send_batch() */
+    size_t send_batch_frames;
+    size_t send_batch_bytes;
+    amqp_conn_stats_t stats;
     void *(*buffer_alloc)(size_t);
     void (*buffer_free)(void *);
+    /* optional, in front of buffer_alloc and buffer_free */
+    struct _amqp_slab *slab;
 
     mnarray_t channels;
     struct _amqp_channel *chan0;
     uint16_t error_code;
     mnbytes_t *error_msg;
     int closed:1;
+    int send_noblock:1;
+    /* a delivery boundary, see recv_thread_worker() */
+    int recv_mem_check:1;
 } amqp_conn_t;
 
 
 typedef struct _amqp_pending_pub {
-    DTQUEUE_ENTRY(_amqp_pending_pub, link);
     mnthr_signal_t sig;
     uint64_t publish_tag;
 } amqp_pending_pub_t;
 
 
+/*
+ * unconfirmed publishes, a ring indexed by publish tag
+ */
+typedef struct _amqp_confirm_slot {
+    /* waiting publisher, NULL if none */
+    amqp_pending_pub_t *pp;
+    uint64_t ts;
+    int pending:1;
+} amqp_confirm_slot_t;
+
+typedef struct _amqp_confirm_tracker {
+    amqp_confirm_slot_t *slots;
+    /* power of two */
+    size_t sz;
+    /* oldest unconfirmed tag, or next if none */
+    uint64_t base;
+    /* tag of the next publish */
+    uint64_t next;
+    size_t npending;
+} amqp_confirm_tracker_t;
+
+
+/*
+ * consumer deliveries by delivery tag, see amqp_consumer_ack()
+ */
+typedef struct _amqp_delivery_tracker {
+    uint8_t *state;
+    /* power of two */
+    size_t sz;
+    /* oldest delivery not covered by a sent basic.ack or basic.nack */
+    uint64_t base;
+    /* tag of the next delivery */
+    uint64_t next;
+    /* acked deliveries whose basic.ack is not sent yet */
+    size_t nready;
+    uint64_t ready_since;
+} amqp_delivery_tracker_t;
+
+
+typedef struct _amqp_consumer_ack_stats {
+    /* deliveries acknowledged with basic.ack */
+    uint64_t acked;
+    /* basic.ack frames sent */
+    uint64_t ack_frames;
+    /* basic.ack frames saved by coalescing */
+    uint64_t ack_frames_saved;
+    /* deliveries rejected with basic.nack */
+    uint64_t nacked;
+} amqp_consumer_ack_stats_t;
+
+
+/*
+ * adaptive prefetch, see amqp_channel_qos_auto()
+ */
+typedef struct _amqp_qos_stats {
+    /* prefetch_count in effect */
+    uint16_t prefetch_count;
+    /* basic.qos re-issued by the controller */
+    uint64_t adjustments;
+    /* averaged basic.qos round trip, delivery interval and handling time */
+    uint64_t rtt_nsec;
+    uint64_t arrival_nsec;
+    uint64_t handler_nsec;
+    /* deliveries waiting for their handler at the last sample */
+    size_t depth;
+} amqp_qos_stats_t;
+
+
+typedef void (*amqp_channel_confirm_cb_t)(struct _amqp_channel *,
+                                          uint64_t,
+                                          int,
+                                          void *);
+
 typedef struct _amqp_channel {
     amqp_conn_t *conn;
     /* incoming frames */
@@ -72,11 +220,40 @@ typedef struct _amqp_channel {
     struct _amqp_consumer *default_consumer;
     /* weak ref */
     struct _amqp_consumer *content_consumer;
+    /* weak ref, awaiting basic.consume-ok */
+    struct _amqp_consumer *consume_pending;
+    /* basic.consume with no-ack sent, see next_frame() */
+    size_t noack_consumers;
     uint64_t publish_tag;
-    DTQUEUE(_amqp_pending_pub, pending_pub);
+    amqp_confirm_tracker_t confirms;
+    /* asynchronous confirms, see amqp_channel_confirm_async() */
+    amqp_channel_confirm_cb_t confirm_cb;
+    void *confirm_udata;
+    size_t confirm_window;
+    mnthr_cond_t confirm_cond;
+    /* consumer acks, see amqp_consumer_ack() */
+    amqp_delivery_tracker_t deliveries;
+    size_t ack_batch;
+    uint64_t ack_batch_nsec;
+    amqp_consumer_ack_stats_t ack_stats;
+    /* adaptive prefetch, see amqp_channel_qos_auto() */
+    mnthr_ctx_t *qos_thread;
+    uint16_t qos_min;
+    uint16_t qos_max;
+    uint64_t qos_interval;
+    uint64_t qos_last_arrival;
+    amqp_qos_stats_t qos_stats;
+    /* outgoing frames, and the round-robin state over conn->ochannels */
+    STQUEUE(_amqp_frame, oframes);
+    DTQUEUE_ENTRY(_amqp_channel, olink);
+    ssize_t odeficit;
+    unsigned oweight;
+    /* frames held back from a streamed publish, see amqp_conn_stream_begin() */
+    STQUEUE(_amqp_frame, oparked);
     int id;
     int confirm_mode:1;
     int closed:1;
+    int ostream:1;
 } amqp_channel_t;
 
 
@@ -84,7 +261,10 @@ typedef struct _amqp_pending_content {
     STQUEUE_ENTRY(_amqp_pending_content, link);
     amqp_frame_t *method;
     amqp_frame_t *header;
-    STQUEUE(_amqp_frame, body);
+    /* body_size buffer, filled in as body frames arrive */
+    char *data;
+    /* a streaming callback has given up on this delivery */
+    int stream_skip:1;
 } amqp_pending_content_t;
 
 typedef int (*amqp_consumer_content_cb_t)(amqp_frame_t *,
@@ -92,6 +272,69 @@ typedef int (*amqp_consumer_content_cb_t)(amqp_frame_t *,
                                           char *,
                                           void *);
 
+/*
+ * a delivery shared by reference count, see amqp_consumer_handle_messages()
+ */
+typedef struct _amqp_message {
+    amqp_frame_t *method;
+    amqp_frame_t *header;
+    /* body_size octets */
+    char *data;
+    void (*buffer_free)(void *);
+    /* the header properties encoded once, see amqp_channel_publish_message() */
+    mnbytestream_t *props;
+    size_t nref;
+} amqp_message_t;
+
+typedef int (*amqp_consumer_message_cb_t)(amqp_message_t *, void *);
+
+typedef uint64_t (*amqp_consumer_key_cb_t)(amqp_frame_t *,
+                                           amqp_frame_t *,
+                                           void *);
+
+/*
+ * streaming consumers, see amqp_consumer_handle_content_stream()
+ */
+typedef int (*amqp_consumer_header_cb_t)(amqp_frame_t *,
+                                         amqp_frame_t *,
+                                         void *);
+
+typedef int (*amqp_consumer_chunk_cb_t)(amqp_frame_t *,
+                                        const char *,
+                                        size_t,
+                                        void *);
+
+/*
+ * one delivery of a batch, see amqp_consumer_handle_content_batch()
+ */
+typedef struct _amqp_delivery {
+    amqp_frame_t *method;
+    amqp_frame_t *header;
+    /* passed over to the batch callback, as to content_cb */
+    char *data;
+    /* 0 to ack, MNAMQP_CONSUME_NACK or MNAMQP_CONSUME_DEFER */
+    int res;
+} amqp_delivery_t;
+
+typedef int (*amqp_consumer_batch_cb_t)(amqp_delivery_t *, size_t, void *);
+
+typedef struct _amqp_consumer_flow_stats {
+    /* deliveries, and their body octets, waiting for the content thread */
+    size_t pending;
+    size_t pending_bytes;
+    /* times the connection stopped reading for this consumer */
+    uint64_t throttles;
+    /* time spent so */
+    uint64_t throttled_nsec;
+} amqp_consumer_flow_stats_t;
+
+typedef struct _amqp_consumer_worker {
+    struct _amqp_consumer *cons;
+    STQUEUE(_amqp_pending_content, queue);
+    mnthr_cond_t cond;
+    mnthr_ctx_t *thread;
+} amqp_consumer_worker_t;
+
 typedef struct _amqp_consumer {
     amqp_channel_t *chan;
     mnbytes_t *consumer_tag;
@@ -101,8 +344,40 @@ typedef struct _amqp_consumer {
     amqp_consumer_content_cb_t content_cb;
     amqp_consumer_content_cb_t cancel_cb;
     void *content_udata;
+    /* instead of content_cb, see amqp_consumer_handle_messages() */
+    amqp_consumer_message_cb_t message_cb;
+    /* worker pool, see amqp_consumer_handle_content_pool() */
+    amqp_consumer_worker_t *workers;
+    size_t nworkers;
+    size_t worker_qlen;
+    amqp_consumer_key_cb_t key_cb;
+    mnthr_cond_t worker_room;
+    int worker_res;
+    /* streaming, see amqp_consumer_handle_content_stream() */
+    amqp_consumer_header_cb_t header_cb;
+    amqp_consumer_chunk_cb_t chunk_cb;
+    amqp_pending_content_t *stream_pc;
+    char *stream_buf;
+    size_t stream_buf_sz;
+    int stream_res;
+    /* batches, see amqp_consumer_handle_content_batch() */
+    amqp_consumer_batch_cb_t batch_cb;
+    STQUEUE(_amqp_pending_content, batch_content);
+    amqp_delivery_t *batch;
+    size_t batch_max;
+    uint64_t batch_nsec;
+    uint64_t batch_since;
+    /* pending budget, see amqp_consumer_set_pending_limits() */
+    size_t pending_high;
+    size_t pending_low;
+    size_t pending_bytes_high;
+    size_t pending_bytes_low;
+    amqp_consumer_flow_stats_t flow_stats;
+    uint64_t throttled_since;
     uint8_t flags;
     int closed:1;
+    int workers_stop:1;
+    int throttled:1;
 } amqp_consumer_t;
 
 
@@ -190,6 +465,17 @@ amqp_conn_t *amqp_conn_new(const char *,
                            short,
                            int);
 size_t amqp_conn_oframes_length(amqp_conn_t *);
+void amqp_conn_set_send_batch(amqp_conn_t *, size_t, size_t);
+#define SEND_NOBLOCK                    0x01
+void amqp_conn_set_send_watermarks(amqp_conn_t *, size_t, size_t, int);
+size_t amqp_conn_oframes_bytes(amqp_conn_t *);
+void amqp_conn_get_stats(amqp_conn_t *, amqp_conn_stats_t *);
+/*
+ * to be called before any traffic, fails while body buffers are out
+ */
+int amqp_conn_set_buffer_slab(amqp_conn_t *, size_t);
+void amqp_conn_trim_buffer_slab(amqp_conn_t *, size_t);
+void amqp_conn_get_slab_stats(amqp_conn_t *, amqp_slab_stats_t *);
 void amqp_conn_destroy(amqp_conn_t **);
 int amqp_conn_open(amqp_conn_t *);
 MNAMQP_SYNC int amqp_conn_run(amqp_conn_t *);
@@ -206,6 +492,12 @@ MNAMQP_SYNC amqp_channel_t *amqp_create_channel(amqp_conn_t *);
 size_t amqp_channel_iframes_length(amqp_channel_t *);
 #define CHANNEL_CONFIRM_FNOWAIT         0x01
 MNAMQP_SYNC int amqp_channel_confirm(amqp_channel_t *, uint8_t);
+MNAMQP_SYNC int amqp_channel_confirm_async(amqp_channel_t *,
+                                           size_t,
+                                           amqp_channel_confirm_cb_t,
+                                           void *);
+uint64_t amqp_channel_publish_tag(amqp_channel_t *);
+int amqp_channel_oldest_unconfirmed(amqp_channel_t *, uint64_t *, uint64_t *);
 MNAMQP_SYNC int amqp_close_channel(amqp_channel_t *);
 void amqp_close_channel_fast(amqp_channel_t *);
 
@@ -263,6 +555,11 @@ MNAMQP_SYNC int amqp_channel_qos(amqp_channel_t *,
                      uint32_t,
                      uint16_t,
                      uint8_t);
+MNAMQP_SYNC int amqp_channel_qos_auto(amqp_channel_t *,
+                                      uint16_t,
+                                      uint16_t,
+                                      uint64_t);
+void amqp_channel_get_qos_stats(amqp_channel_t *, amqp_qos_stats_t *);
 
 #define FLOW_ACTIVE                     0x01
 MNAMQP_SYNC int amqp_channel_flow(amqp_channel_t *, uint8_t);
@@ -307,6 +604,61 @@ MNAMQP_SYNC int amqp_channel_publish_ex(amqp_channel_t *,
 
 typedef int (*amqp_channel_publish_cb_t)(amqp_conn_t *, void *);
 
+typedef void (*amqp_body_release_cb_t)(void *);
+
+MNAMQP_SYNC int amqp_channel_publish_ref(amqp_channel_t *,
+                            const char *,
+                            const char *,
+                            uint8_t,
+                            amqp_header_completion_cb,
+                            void *,
+                            const char *,
+                            ssize_t,
+                            amqp_body_release_cb_t,
+                            void *);
+
+MNAMQP_SYNC int amqp_channel_publishv(amqp_channel_t *,
+                                      const char *,
+                                      const char *,
+                                      uint8_t,
+                                      amqp_header_completion_cb,
+                                      void *,
+                                      const struct iovec *,
+                                      int,
+                                      ssize_t,
+                                      amqp_body_release_cb_t,
+                                      void *);
+
+MNAMQP_SYNC int amqp_channel_publish_fd(amqp_channel_t *,
+                                        const char *,
+                                        const char *,
+                                        uint8_t,
+                                        amqp_header_completion_cb,
+                                        void *,
+                                        int,
+                                        off_t,
+                                        ssize_t,
+                                        amqp_body_release_cb_t,
+                                        void *);
+
+/*
+ * fill up to sz octets of the buffer, return how many, see
+ * amqp_channel_publish_stream()
+ */
+typedef ssize_t (*amqp_body_producer_cb_t)(char *, size_t, void *);
+
+MNAMQP_SYNC int amqp_channel_publish_stream(amqp_channel_t *,
+                                            const char *,
+                                            const char *,
+                                            uint8_t,
+                                            amqp_header_completion_cb,
+                                            void *,
+                                            ssize_t,
+                                            amqp_body_producer_cb_t,
+                                            void *,
+                                            amqp_body_release_cb_t,
+                                            void *);
+
 MNAMQP_SYNC int amqp_channel_publish_ex2(amqp_channel_t *,
                             const char *,
                             const char *,
@@ -315,9 +667,39 @@ MNAMQP_SYNC int amqp_channel_publish_ex2(amqp_channel_t *,
                             amqp_channel_publish_cb_t,
                             void *);
 
+/*
+ * publish templates: the basic.publish method and the content header
+ * properties for a fixed (exchange, routing key, flags) encoded once
+ */
+typedef struct _amqp_publish_template {
+    mnbytestream_t method;
+    mnbytestream_t props;
+    size_t nref;
+} amqp_publish_template_t;
+
+amqp_publish_template_t *amqp_publish_template_new(const char *,
+                                                   const char *,
+                                                   uint8_t,
+                                                   amqp_header_t *);
+void amqp_publish_template_destroy(amqp_publish_template_t **);
+
+struct _amqp_header_builder;
+MNAMQP_SYNC int amqp_channel_publish_template(amqp_channel_t *,
+                                              amqp_publish_template_t *,
+                                              struct _amqp_header_builder *,
+                                              const char *,
+                                              ssize_t);
+
+MNAMQP_SYNC int amqp_channel_publish_message(amqp_channel_t *,
+                                             const char *,
+                                             const char *,
+                                             uint8_t,
+                                             amqp_message_t *);
+
 #define ACK_MULTIPLE                    0x01
 
 void amqp_channel_drain_methods(amqp_channel_t *);
+void amqp_channel_set_send_weight(amqp_channel_t *, unsigned);
 
 /*
  * consumer
@@ -343,6 +725,52 @@ int amqp_consumer_handle_content(amqp_consumer_t *,
                                  amqp_consumer_content_cb_t,
                                  void *);
 
+int amqp_consumer_handle_content_pool(amqp_consumer_t *,
+                                      size_t,
+                                      size_t,
+                                      amqp_consumer_key_cb_t,
+                                      amqp_consumer_content_cb_t,
+                                      amqp_consumer_content_cb_t,
+                                      void *);
+
+int amqp_consumer_handle_content_stream(amqp_consumer_t *,
+                                        amqp_consumer_header_cb_t,
+                                        amqp_consumer_chunk_cb_t,
+                                        amqp_consumer_content_cb_t,
+                                        amqp_consumer_content_cb_t,
+                                        void *);
+
+int amqp_consumer_handle_content_batch(amqp_consumer_t *,
+                                       size_t,
+                                       uint64_t,
+                                       amqp_consumer_batch_cb_t,
+                                       amqp_consumer_content_cb_t,
+                                       void *);
+
+int amqp_consumer_handle_messages(amqp_consumer_t *,
+                                  amqp_consumer_message_cb_t,
+                                  amqp_consumer_content_cb_t,
+                                  void *);
+amqp_message_t *amqp_message_retain(amqp_message_t *);
+void amqp_message_release(amqp_message_t **);
+
+void amqp_consumer_set_pending_limits(amqp_consumer_t *,
+                                      size_t,
+                                      size_t,
+                                      size_t,
+                                      size_t);
+void amqp_consumer_get_flow_stats(amqp_consumer_t *,
+                                  amqp_consumer_flow_stats_t *);
+
+void amqp_consumer_set_ack_batch(amqp_consumer_t *, size_t, uint64_t);
+int amqp_consumer_ack(amqp_consumer_t *, uint64_t);
+#define NACK_REQUEUE                    0x02
+int amqp_consumer_nack(amqp_consumer_t *, uint64_t, int);
+#define REJECT_REQUEUE                  0x01
+int amqp_consumer_reject(amqp_consumer_t *, uint64_t, int);
+void amqp_consumer_get_ack_stats(amqp_consumer_t *,
+                                 amqp_consumer_ack_stats_t *);
+
 MNAMQP_SYNC int amqp_close_consumer(amqp_consumer_t *);
 void amqp_close_consumer_fast(amqp_consumer_t *);
 
@@ -352,10 +780,47 @@ void amqp_close_consumer_fast(amqp_consumer_t *);
  */
 int amqp_header_dec(struct _amqp_conn *, amqp_header_t **);
 int amqp_header_enc(amqp_header_t *, struct _amqp_conn *);
+void amqp_header_enc_props(amqp_header_t *, mnbytestream_t *);
 amqp_header_t *amqp_header_new(void);
 void amqp_header_destroy(amqp_header_t **);
 void amqp_header_dump(amqp_header_t *);
 
+/*
+ * header builder: static properties are encoded once at init, per-message
+ * ones as they are set, and the two are merged in flag order on publish,
+ * see amqp_channel_publish_template()
+ */
+typedef struct _amqp_header_span {
+    uint32_t off;
+    uint32_t sz;
+} amqp_header_span_t;
+
+typedef struct _amqp_header_builder {
+    mnbytestream_t statics;
+    mnbytestream_t msg;
+    /* indexed by property flag bit */
+    amqp_header_span_t spans[16];
+    amqp_header_span_t msg_spans[16];
+    uint16_t static_flags;
+    uint16_t msg_flags;
+} amqp_header_builder_t;
+
+void amqp_header_builder_init(amqp_header_builder_t *, amqp_header_t *);
+void amqp_header_builder_fini(amqp_header_builder_t *);
+void amqp_header_builder_reset(amqp_header_builder_t *);
+size_t amqp_header_builder_size(amqp_header_builder_t *);
+void amqp_header_builder_copy(amqp_header_builder_t *, char *);
+
+#define AMQP_HEADER_BUILDER_SET_DECL(n, ty)                            \
+void amqp_header_builder_set_##n(amqp_header_builder_t *hb, ty v)      \
+
+AMQP_HEADER_BUILDER_SET_DECL(correlation_id, mnbytes_t *);
+AMQP_HEADER_BUILDER_SET_DECL(reply_to, mnbytes_t *);
+AMQP_HEADER_BUILDER_SET_DECL(expiration, mnbytes_t *);
+AMQP_HEADER_BUILDER_SET_DECL(message_id, mnbytes_t *);
+AMQP_HEADER_BUILDER_SET_DECL(timestamp, uint64_t);
+AMQP_HEADER_BUILDER_SET_DECL(type, mnbytes_t *);
+
 #define AMQP_HEADER_SET_REF(n) amqp_header_set_##n
 #define AMQP_HEADER_SETH_REF(n) amqp_header_set_headers_add_##n
 
@@ -400,6 +865,11 @@ AMQP_HEADER_SET_DECL(cluster_id, mnbytes_t *);
 #define MNAMQP_STOP_THREADS (-128)
 #define MNAMQP_PROTOCOL_ERROR (-129)
 #define MNAMQP_CONSUME_NACK (-130)
+#define MNAMQP_CONFIRM_NACK (-131)
+/* content_cb leaves the ack to amqp_consumer_ack() and friends */
+#define MNAMQP_CONSUME_DEFER (-132)
+/* the send queue is above its high watermark, and SEND_NOBLOCK is set */
+#define MNAMQP_SEND_WOULDBLOCK (-133)
 /*
  * rpc
  */
@@ -425,6 +895,12 @@ MNAMQP_SYNC int amqp_rpc_call(amqp_rpc_t *,
  */
 void mnamqp_init(void);
 void mnamqp_fini(void);
+void mnamqp_set_memory_cap(size_t);
+void mnamqp_memory_stats(amqp_memory_stats_t *);
+void mnamqp_pool_stats(amqp_pool_stats_t *,
+                       amqp_pool_stats_t *,
+                       amqp_pool_stats_t *,
+                       amqp_pool_stats_t *);
 
 const char *mnamqp_diag_str(int);
 
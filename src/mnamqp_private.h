@@ -85,6 +85,12 @@ struct _amqp_channel;
 struct _amqp_rpc;
 struct _amqp_meth_params;
 struct _amqp_header;
+struct _amqp_pending_pub;
+struct _amqp_confirm_slot;
+struct _amqp_confirm_tracker;
+struct _amqp_pool_stats;
+struct _amqp_delivery_tracker;
+struct _amqp_publish_template;
 struct _amqp_header;
 
 typedef void (*amqp_encode)(struct _amqp_value *, mnbytestream_t *);
@@ -131,7 +137,71 @@ typedef struct _amqp_value {
 #define AMQP_FHEADER 2
 #define AMQP_FBODY 3
 #define AMQP_FBODYEX 4
+#define AMQP_FBODYREF 5
+#define AMQP_FMETHODRAW 6
+#define AMQP_FHEADERRAW 7
 #define AMQP_FHEARTBEAT 8
+#define AMQP_FBODYV 9
+
+/*
+ * header builder span of property flag f
+ */
+#define AMQP_HEADER_SPAN(spans, f) ((spans)[ffs(f) - 1])
+
+/*
+ * frame type octet put on the wire, body references and pre-encoded
+ * frames go out as their ordinary counterparts
+ */
+#define AMQP_FRAME_WIRE_TYPE(ty)               \
+(                                              \
+    (ty) == AMQP_FBODYREF ? AMQP_FBODY :       \
+    (ty) == AMQP_FBODYV ? AMQP_FBODY :         \
+    (ty) == AMQP_FMETHODRAW ? AMQP_FMETHOD :   \
+    (ty) == AMQP_FHEADERRAW ? AMQP_FHEADER :   \
+    (ty)                                       \
+)                                              \
+
+
+/*
+ * body references, see amqp_channel_publish_ref()
+ */
+typedef struct _amqp_body_ref {
+    size_t nref;
+    void (*release)(void *);
+    void *udata;
+    /* copy of the caller's iovec array, see amqp_channel_publishv() */
+    struct iovec *iov;
+} amqp_body_ref_t;
+
+/*
+ * a file range mapped by amqp_channel_publish_fd()
+ */
+typedef struct _amqp_body_map {
+    void *addr;
+    size_t len;
+    void (*release)(void *);
+    void *udata;
+} amqp_body_map_t;
+
+/*
+ * bodies shorter than this are copied into the output buffer rather than
+ * written straight from the caller's buffer
+ */
+#define AMQP_BODYREF_WRITE_MIN 4096
+
+/*
+ * body payload remainders this large are read from the socket straight
+ * into the message buffer rather than through the input buffer
+ */
+#define AMQP_BODY_DIRECT_READ_MIN 4096
+
+/*
+ * streamed bodies are pulled in chunks this large at most, and their
+ * publisher waits while more than AMQP_BODY_STREAM_QUEUED octets are
+ * queued on the connection, see amqp_channel_publish_stream()
+ */
+#define AMQP_BODY_CHUNK 65536
+#define AMQP_BODY_STREAM_QUEUED (4 * AMQP_BODY_CHUNK)
 
 typedef struct _amqp_frame {
     STQUEUE_ENTRY(_amqp_frame, link);
@@ -143,19 +213,66 @@ typedef struct _amqp_frame {
             int (*cb)(struct _amqp_conn *, void *);
             void *udata;
         } bodyex;
+        struct {
+            const char *data;
+            amqp_body_ref_t *ref;
+        } bodyref;
+        struct {
+            /* first segment, and where in it the frame starts */
+            const struct iovec *iov;
+            size_t off;
+            amqp_body_ref_t *ref;
+        } bodyv;
+        struct {
+            struct _amqp_publish_template *tpl;
+            uint64_t body_size;
+            /* header properties of their own, props_sz long */
+            char *props;
+            size_t props_sz;
+            /* or the ones of a message, see amqp_channel_publish_message() */
+            struct _amqp_message *msg;
+        } raw;
     } payload;
     uint32_t sz;
     uint16_t chan;
     uint8_t type;
 } amqp_frame_t;
 
+/*
+ * queued frames are accounted with their type, channel, size and end
+ * octets on top of fr->sz
+ */
+#define AMQP_FRAME_OVERHEAD 8
+
+/*
+ * payload of a pre-encoded header frame: class-id, weight, body-size and
+ * sz octets of properties
+ */
+#define AMQP_HEADERRAW_SIZE(sz) (2 + 2 + 8 + (sz))
+
+/*
+ * octets a channel of weight 1 may send per round-robin turn, see
+ * amqp_channel_set_send_weight()
+ */
+#define AMQP_SEND_QUANTUM 16384
+
+/*
+ * send batching defaults, see amqp_conn_set_send_batch()
+ */
+#define AMQP_SEND_BATCH_FRAMES_DEFAULT 1024
+#define AMQP_SEND_BATCH_BYTES_DEFAULT 65536
+
 #define AMQP_FRAME_TYPE_STR(ty)                \
 (                                              \
     ty == AMQP_FMETHOD ? "METHOD" :            \
     ty == AMQP_FHEADER ? "HEADER" :            \
     ty == AMQP_FBODY ? "BODY" :                \
     ty == AMQP_FBODYEX ? "BODYEX" :            \
+    ty == AMQP_FBODYREF ? "BODYREF" :          \
+    ty == AMQP_FMETHODRAW ? "METHODRAW" :      \
+    ty == AMQP_FHEADERRAW ? "HEADERRAW" :      \
     ty == AMQP_FHEARTBEAT ? "HEARTBEAT" :      \
+    ty == AMQP_FBODYV ? "BODYV" :              \
     "<unknown>"                                \
 )                                              \
 
@@ -248,6 +365,51 @@ typedef void (*amqp_method_fini_t) (struct _amqp_meth_params *);
 
 typedef uint64_t amqp_meth_id_t;
 
+/*
+ * freelist of fixed size objects
+ */
+#define AMQP_POOL_MAX_DEFAULT 1024
+typedef struct _amqp_pool {
+    size_t sz;
+    /* cap on cached objects */
+    size_t nmax;
+    void *free;
+    size_t nfree;
+    uint64_t hits;
+    uint64_t misses;
+} amqp_pool_t;
+#define AMQP_POOL_INITIALIZER(sz_) {sz_, AMQP_POOL_MAX_DEFAULT, NULL, 0, 0, 0}
+
+/*
+ * body buffer slab counters, see amqp_conn_set_buffer_slab()
+ */
+typedef struct _amqp_slab_stats {
+    /* allocations served from the free lists, and passed down */
+    uint64_t hits;
+    uint64_t misses;
+    /* buffers freed rather than cached, above the high-water mark */
+    uint64_t trimmed;
+    /* octets cached for reuse */
+    size_t cached;
+    size_t cached_peak;
+} amqp_slab_stats_t;
+
+/*
+ * free lists of body buffers by power of two size class, see slab.c
+ */
+#define AMQP_SLAB_MIN_SHIFT 6
+#define AMQP_SLAB_NCLASSES 27
+typedef struct _amqp_slab {
+    void *free[AMQP_SLAB_NCLASSES];
+    /* largest class, larger buffers bypass the slab */
+    size_t max;
+    /* cap on cached octets */
+    size_t hwm;
+    void *(*alloc)(size_t);
+    void (*free_)(void *);
+    amqp_slab_stats_t stats;
+} amqp_slab_t;
+
 typedef struct _amqp_method_info {
     char *name;
     amqp_meth_id_t mid;
@@ -256,6 +418,7 @@ typedef struct _amqp_method_info {
     amqp_method_enc_t enc;
     amqp_method_dec_t dec;
     amqp_method_fini_t fini;
+    amqp_pool_t pool;
 } amqp_method_info_t;
 
 
@@ -745,6 +908,102 @@ void amqp_frame_destroy_header(amqp_frame_t **);
 void amqp_frame_destroy_body(struct _amqp_conn *, amqp_frame_t **);
 void amqp_frame_destroy(struct _amqp_conn *, amqp_frame_t **);
 void amqp_frame_dump(amqp_frame_t *);
+amqp_body_ref_t *amqp_body_ref_new(void (*)(void *), void *);
+void amqp_body_ref_incref(amqp_body_ref_t *);
+void amqp_body_ref_decref(amqp_body_ref_t **);
+void amqp_publish_template_incref(struct _amqp_publish_template *);
+void amqp_publish_template_decref(struct _amqp_publish_template **);
+struct _amqp_message *amqp_message_new(amqp_frame_t *,
+                                       amqp_frame_t *,
+                                       char *,
+                                       void (*)(void *));
+
+
+/*
+ * body buffer accounting API
+ */
+void amqp_memory_init(void);
+void amqp_memory_fini(void);
+void *amqp_conn_buffer_alloc(struct _amqp_conn *, size_t);
+void amqp_conn_buffer_passed(struct _amqp_conn *, size_t);
+void amqp_conn_buffer_free(struct _amqp_conn *, void *, size_t);
+void *amqp_conn_obuffer_alloc(struct _amqp_conn *, size_t);
+void amqp_conn_obuffer_free(struct _amqp_conn *, void *, size_t);
+int amqp_memory_over_cap(void);
+int amqp_memory_out_over_cap(void);
+int amqp_memory_wait(void);
+void amqp_memory_wakeup(void);
+
+
+/*
+ * slab API
+ */
+amqp_slab_t *amqp_slab_new(size_t,
+                           size_t,
+                           void *(*)(size_t),
+                           void (*)(void *));
+void amqp_slab_destroy(amqp_slab_t **);
+void *amqp_slab_alloc(amqp_slab_t *, size_t);
+void amqp_slab_free(amqp_slab_t *, void *, size_t);
+void amqp_slab_trim(amqp_slab_t *, size_t);
+
+
+/*
+ * pool API
+ */
+extern amqp_pool_t amqp_frame_pool;
+extern amqp_pool_t amqp_header_pool;
+extern amqp_pool_t amqp_pending_content_pool;
+void *amqp_pool_get(amqp_pool_t *);
+void amqp_pool_put(amqp_pool_t *, void *);
+void amqp_pool_fini(amqp_pool_t *);
+void amqp_pool_stats_add(amqp_pool_t *, struct _amqp_pool_stats *);
+
+
+/*
+ * confirm tracker API
+ */
+typedef void (*amqp_confirm_settle_cb_t)(struct _amqp_confirm_slot *,
+                                         uint64_t,
+                                         int,
+                                         void *);
+void amqp_confirm_tracker_init(struct _amqp_confirm_tracker *);
+void amqp_confirm_tracker_fini(struct _amqp_confirm_tracker *);
+uint64_t amqp_confirm_tracker_add(struct _amqp_confirm_tracker *,
+                                  struct _amqp_pending_pub *,
+                                  uint64_t);
+void amqp_confirm_tracker_forget(struct _amqp_confirm_tracker *, uint64_t);
+size_t amqp_confirm_tracker_settle(struct _amqp_confirm_tracker *,
+                                   uint64_t,
+                                   int,
+                                   int,
+                                   amqp_confirm_settle_cb_t,
+                                   void *);
+struct _amqp_confirm_slot *
+amqp_confirm_tracker_oldest(struct _amqp_confirm_tracker *, uint64_t *);
+
+
+/*
+ * delivery tracker API
+ */
+#define AMQP_DELIVERY_UNSETTLED 1
+#define AMQP_DELIVERY_ACKED 2
+typedef void (*amqp_delivery_ack_cb_t)(uint64_t, size_t, void *);
+void amqp_delivery_tracker_init(struct _amqp_delivery_tracker *);
+void amqp_delivery_tracker_fini(struct _amqp_delivery_tracker *);
+void amqp_delivery_tracker_add(struct _amqp_delivery_tracker *,
+                               uint64_t,
+                               int);
+int amqp_delivery_tracker_unsettled(struct _amqp_delivery_tracker *,
+                                    uint64_t);
+int amqp_delivery_tracker_ack(struct _amqp_delivery_tracker *,
+                              uint64_t,
+                              uint64_t);
+int amqp_delivery_tracker_settle(struct _amqp_delivery_tracker *, uint64_t);
+size_t amqp_delivery_tracker_collect(struct _amqp_delivery_tracker *,
+                                     int,
+                                     amqp_delivery_ack_cb_t,
+                                     void *);
 
 
 /*
@@ -752,6 +1011,7 @@ void amqp_frame_dump(amqp_frame_t *);
  */
 void amqp_spec_init(void);
 void amqp_spec_fini(void);
+void amqp_spec_pool_stats(struct _amqp_pool_stats *);
 amqp_method_info_t *amqp_method_info_get(amqp_meth_id_t);
 
 
@@ -782,6 +1042,7 @@ NEWDECL(basic_cancel_ok);
 NEWDECL(basic_publish);
 NEWDECL(basic_deliver);
 NEWDECL(basic_ack);
+NEWDECL(basic_reject);
 NEWDECL(basic_nack);
 
 
@@ -795,6 +1056,22 @@ void amqp_meth_params_dump(amqp_meth_params_t *);
 void amqp_meth_params_destroy(amqp_meth_params_t **);
 
 
+/*
+ * extended connection API
+ */
+void amqp_conn_recv_wait_begin(struct _amqp_conn *);
+void amqp_conn_recv_wait_end(struct _amqp_conn *);
+void amqp_conn_queue_oframe(struct _amqp_conn *,
+                            struct _amqp_channel *,
+                            amqp_frame_t *);
+void amqp_conn_stream_begin(struct _amqp_conn *, struct _amqp_channel *);
+void amqp_conn_queue_stream_oframe(struct _amqp_conn *,
+                                   struct _amqp_channel *,
+                                   amqp_frame_t *);
+void amqp_conn_stream_end(struct _amqp_conn *, struct _amqp_channel *);
+amqp_frame_t *amqp_conn_next_oframe(struct _amqp_conn *);
+
+
 /*
  * extended channel API
  */
@@ -0,0 +1,185 @@
+#include <assert.h>
+
+#ifdef DO_MEMDEBUG
+#include <mncommon/memdebug.h>
+MEMDEBUG_DECLARE(mnamqp_oframe);
+#endif
+
+#include <mncommon/dumpm.h>
+#include <mncommon/util.h>
+
+#include <mnamqp_private.h>
+
+#include "diag.h"
+
+/*
+ * Outbound frame scheduling.
+ *
+ * The control lane goes first.  A method is put there only while its
+ * channel has no frames queued, so taking it ahead never reorders the
+ * frames of one channel, and never splits a content set.
+ *
+ * Then channels take turns.  The channel at the head of ochannels keeps
+ * sending until its deficit runs out at a content set boundary, a set is
+ * never cut short, and an overdraft is carried into its next turn.  At the
+ * end of the turn the deficit is topped up by the channel's quantum, and
+ * the channel goes to the back of the line.
+ *
+ * While a streamed publish is between its header and its last body frame,
+ * see amqp_conn_stream_begin(), any other frame of its channel is parked
+ * until the content set is complete, so that nothing lands inside it.
+ */
+
+/*
+ * frames of a content set: basic.publish, the header and the body
+ */
+static int
+frame_is_content(amqp_frame_t *fr)
+{
+    switch (fr->type) {
+    case AMQP_FMETHOD:
+        return fr->payload.params->mi->mid == AMQP_BASIC_PUBLISH;
+
+    case AMQP_FHEARTBEAT:
+        return 0;
+
+    default:
+        return 1;
+    }
+}
+
+
+/*
+ * frames that a content set or a lone method begins with
+ */
+static int
+frame_starts_unit(amqp_frame_t *fr)
+{
+    return fr->type == AMQP_FMETHOD ||
+           fr->type == AMQP_FMETHODRAW ||
+           fr->type == AMQP_FHEARTBEAT;
+}
+
+
+static void
+conn_queue_oframe(amqp_conn_t *conn,
+                  amqp_channel_t *chan,
+                  amqp_frame_t *fr)
+{
+    if (STQUEUE_EMPTY(&chan->oframes)) {
+        if (!frame_is_content(fr)) {
+            STQUEUE_ENQUEUE(&conn->ocontrol, link, fr);
+            goto end;
+        }
+        chan->odeficit = AMQP_SEND_QUANTUM * chan->oweight;
+        DTQUEUE_ENQUEUE(&conn->ochannels, olink, chan);
+    }
+    STQUEUE_ENQUEUE(&chan->oframes, link, fr);
+    ++conn->oframes;
+
+end:
+    conn->oframes_bytes += AMQP_FRAME_OVERHEAD + fr->sz;
+}
+
+
+void
+amqp_conn_queue_oframe(amqp_conn_t *conn,
+                       amqp_channel_t *chan,
+                       amqp_frame_t *fr)
+{
+    if (chan->ostream) {
+        STQUEUE_ENQUEUE(&chan->oparked, link, fr);
+        return;
+    }
+    conn_queue_oframe(conn, chan, fr);
+}
+
+
+/*
+ * the header of a streamed publish is queued, its body frames go through
+ * amqp_conn_queue_stream_oframe() until amqp_conn_stream_end()
+ */
+void
+amqp_conn_stream_begin(UNUSED amqp_conn_t *conn, amqp_channel_t *chan)
+{
+    assert(!chan->ostream);
+    chan->ostream = 1;
+}
+
+
+void
+amqp_conn_queue_stream_oframe(amqp_conn_t *conn,
+                              amqp_channel_t *chan,
+                              amqp_frame_t *fr)
+{
+    assert(chan->ostream);
+    conn_queue_oframe(conn, chan, fr);
+}
+
+
+/*
+ * queue the frames parked since amqp_conn_stream_begin()
+ */
+void
+amqp_conn_stream_end(amqp_conn_t *conn, amqp_channel_t *chan)
+{
+    amqp_frame_t *fr;
+
+    chan->ostream = 0;
+    while ((fr = STQUEUE_HEAD(&chan->oparked)) != NULL) {
+        STQUEUE_DEQUEUE(&chan->oparked, link);
+        STQUEUE_ENTRY_FINI(link, fr);
+        conn_queue_oframe(conn, chan, fr);
+    }
+}
+
+
+/*
+ * the next frame to send, NULL if none
+ */
+amqp_frame_t *
+amqp_conn_next_oframe(amqp_conn_t *conn)
+{
+    amqp_frame_t *fr;
+    amqp_channel_t *chan;
+
+    if ((fr = STQUEUE_HEAD(&conn->ocontrol)) != NULL) {
+        STQUEUE_DEQUEUE(&conn->ocontrol, link);
+        ++conn->stats.ocontrol;
+        goto end;
+    }
+
+    while ((chan = DTQUEUE_HEAD(&conn->ochannels)) != NULL) {
+        fr = STQUEUE_HEAD(&chan->oframes);
+        assert(fr != NULL);
+        if (chan->odeficit > 0 || !frame_starts_unit(fr)) {
+            break;
+        }
+        if (DTQUEUE_LENGTH(&conn->ochannels) == 1) {
+            /* nobody to take turns with, no overdraft to carry */
+            chan->odeficit = AMQP_SEND_QUANTUM * chan->oweight;
+            break;
+        }
+        chan->odeficit += AMQP_SEND_QUANTUM * chan->oweight;
+        DTQUEUE_DEQUEUE(&conn->ochannels, olink);
+        DTQUEUE_ENTRY_FINI(olink, chan);
+        DTQUEUE_ENQUEUE(&conn->ochannels, olink, chan);
+    }
+    if (chan == NULL) {
+        return NULL;
+    }
+
+    STQUEUE_DEQUEUE(&chan->oframes, link);
+    --conn->oframes;
+    chan->odeficit -= AMQP_FRAME_OVERHEAD + fr->sz;
+    if (STQUEUE_EMPTY(&chan->oframes)) {
+        DTQUEUE_DEQUEUE(&conn->ochannels, olink);
+        DTQUEUE_ENTRY_FINI(olink, chan);
+        chan->odeficit = 0;
+    }
+
+end:
+    STQUEUE_ENTRY_FINI(link, fr);
+    conn->oframes_bytes -= AMQP_FRAME_OVERHEAD + fr->sz;
+    return fr;
+}
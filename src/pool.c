@@ -0,0 +1,113 @@
+#include <string.h>
+
+#ifdef DO_MEMDEBUG
+#include <mncommon/memdebug.h>
+MEMDEBUG_DECLARE(mnamqp_pool);
+#endif
+
+#include <mncommon/dumpm.h>
+#include <mncommon/util.h>
+
+#include <mnamqp_private.h>
+
+#include "diag.h"
+
+/*
+ * Freelists of frames, method params, headers and pending contents.
+ *
+ * Objects are recycled on the hot publish and deliver paths.  The library
+ * runs in a single OS thread under mnthr, so the pools are module-wide and
+ * need no locking.  Free objects are chained through their first word.
+ */
+
+amqp_pool_t amqp_frame_pool =
+    AMQP_POOL_INITIALIZER(sizeof(amqp_frame_t));
+amqp_pool_t amqp_header_pool =
+    AMQP_POOL_INITIALIZER(sizeof(amqp_header_t));
+amqp_pool_t amqp_pending_content_pool =
+    AMQP_POOL_INITIALIZER(sizeof(amqp_pending_content_t));
+
+
+void *
+amqp_pool_get(amqp_pool_t *pool)
+{
+    void *res;
+
+    if (pool->free != NULL) {
+        res = pool->free;
+        pool->free = *(void **)res;
+        --pool->nfree;
+        ++pool->hits;
+    } else {
+        if ((res = malloc(pool->sz)) == NULL) {
+            FAIL("malloc");
+        }
+        ++pool->misses;
+    }
+    return res;
+}
+
+
+void
+amqp_pool_put(amqp_pool_t *pool, void *o)
+{
+    if (pool->nfree >= pool->nmax) {
+        free(o);
+    } else {
+        *(void **)o = pool->free;
+        pool->free = o;
+        ++pool->nfree;
+    }
+}
+
+
+void
+amqp_pool_fini(amqp_pool_t *pool)
+{
+    while (pool->free != NULL) {
+        void *o;
+
+        o = pool->free;
+        pool->free = *(void **)o;
+        free(o);
+    }
+    pool->nfree = 0;
+}
+
+
+void
+amqp_pool_stats_add(amqp_pool_t *pool, amqp_pool_stats_t *stats)
+{
+    stats->hits += pool->hits;
+    stats->misses += pool->misses;
+    stats->nfree += pool->nfree;
+}
+
+
+/*
+ * Pool counters of frames, method params (all methods together), headers
+ * and pending contents.  Any argument can be NULL.
+ */
+void
+mnamqp_pool_stats(amqp_pool_stats_t *frames,
+                  amqp_pool_stats_t *params,
+                  amqp_pool_stats_t *headers,
+                  amqp_pool_stats_t *contents)
+{
+    if (frames != NULL) {
+        memset(frames, 0, sizeof(amqp_pool_stats_t));
+        amqp_pool_stats_add(&amqp_frame_pool, frames);
+    }
+    if (params != NULL) {
+        memset(params, 0, sizeof(amqp_pool_stats_t));
+        amqp_spec_pool_stats(params);
+    }
+    if (headers != NULL) {
+        memset(headers, 0, sizeof(amqp_pool_stats_t));
+        amqp_pool_stats_add(&amqp_header_pool, headers);
+    }
+    if (contents != NULL) {
+        memset(contents, 0, sizeof(amqp_pool_stats_t));
+        amqp_pool_stats_add(&amqp_pending_content_pool, contents);
+    }
+}
@@ -392,7 +392,10 @@ amqp_rpc_call(amqp_rpc_t *rpc,
         goto err;
     }
 
-    if (mnthr_signal_subscribe(&cc.sig) != 0) {
+    amqp_conn_recv_wait_begin(rpc->chan->conn);
+    res = mnthr_signal_subscribe(&cc.sig);
+    amqp_conn_recv_wait_end(rpc->chan->conn);
+    if (res != 0) {
         res = AMQP_RPC_CALL + 2;
         goto err;
     }
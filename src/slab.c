@@ -0,0 +1,146 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef DO_MEMDEBUG
+#include <mncommon/memdebug.h>
+MEMDEBUG_DECLARE(mnamqp_slab);
+#endif
+
+#include <mncommon/dumpm.h>
+#include <mncommon/util.h>
+
+#include <mnamqp_private.h>
+
+#include "diag.h"
+
+/*
+ * Free lists of body buffers by size class.
+ *
+ * Body sizes cluster at payload_max and at a few message sizes, so
+ * buffers are rounded up to a power of two, from 64 octets up to the
+ * frame size, and recycled through per class free lists chained through
+ * their first word.  Every buffer is a whole block of the backing
+ * allocator: a delivery body passed over to the application may still be
+ * released with buffer_free, and the slab can be turned off with buffers
+ * outstanding.  Freed buffers are cached while the cache stays under the
+ * high-water mark, and released otherwise.
+ */
+
+static unsigned
+slab_class(size_t sz)
+{
+    unsigned cls;
+
+    for (cls = 0; ((size_t)1 << (cls + AMQP_SLAB_MIN_SHIFT)) < sz; ++cls) {
+        ;
+    }
+    return cls;
+}
+
+
+#define SLAB_CLASS_SZ(cls) ((size_t)1 << ((cls) + AMQP_SLAB_MIN_SHIFT))
+
+
+amqp_slab_t *
+amqp_slab_new(size_t max,
+              size_t hwm,
+              void *(*alloc)(size_t),
+              void (*free_)(void *))
+{
+    amqp_slab_t *slab;
+
+    if ((slab = malloc(sizeof(amqp_slab_t))) == NULL) {
+        FAIL("malloc");
+    }
+    memset(slab, 0, sizeof(amqp_slab_t));
+    slab->max = SLAB_CLASS_SZ(MIN(slab_class(max), AMQP_SLAB_NCLASSES - 1));
+    slab->hwm = hwm;
+    slab->alloc = alloc;
+    slab->free_ = free_;
+    return slab;
+}
+
+
+void
+amqp_slab_destroy(amqp_slab_t **slab)
+{
+    if (*slab != NULL) {
+        amqp_slab_trim(*slab, 0);
+        free(*slab);
+        *slab = NULL;
+    }
+}
+
+
+void *
+amqp_slab_alloc(amqp_slab_t *slab, size_t sz)
+{
+    unsigned cls;
+    void *res;
+
+    if (sz > slab->max) {
+        ++slab->stats.misses;
+        return slab->alloc(sz);
+    }
+    cls = slab_class(sz);
+    if ((res = slab->free[cls]) != NULL) {
+        slab->free[cls] = *(void **)res;
+        slab->stats.cached -= SLAB_CLASS_SZ(cls);
+        ++slab->stats.hits;
+    } else {
+        res = slab->alloc(SLAB_CLASS_SZ(cls));
+        ++slab->stats.misses;
+    }
+    return res;
+}
+
+
+/*
+ * sz as passed to amqp_slab_alloc()
+ */
+void
+amqp_slab_free(amqp_slab_t *slab, void *o, size_t sz)
+{
+    unsigned cls;
+
+    if (sz > slab->max) {
+        slab->free_(o);
+        return;
+    }
+    cls = slab_class(sz);
+    if (slab->stats.cached + SLAB_CLASS_SZ(cls) > slab->hwm) {
+        slab->free_(o);
+        ++slab->stats.trimmed;
+        return;
+    }
+    *(void **)o = slab->free[cls];
+    slab->free[cls] = o;
+    slab->stats.cached += SLAB_CLASS_SZ(cls);
+    slab->stats.cached_peak = MAX(slab->stats.cached_peak,
+                                  slab->stats.cached);
+}
+
+
+/*
+ * Release cached buffers, largest first, down to keep octets.
+ */
+void
+amqp_slab_trim(amqp_slab_t *slab, size_t keep)
+{
+    int cls;
+
+    for (cls = AMQP_SLAB_NCLASSES - 1;
+         cls >= 0 && slab->stats.cached > keep;
+         --cls) {
+        while (slab->free[cls] != NULL && slab->stats.cached > keep) {
+            void *o;
+
+            o = slab->free[cls];
+            slab->free[cls] = *(void **)o;
+            slab->free_(o);
+            slab->stats.cached -= SLAB_CLASS_SZ(cls);
+            ++slab->stats.trimmed;
+        }
+    }
+}
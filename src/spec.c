@@ -1,4 +1,6 @@
 #include <inttypes.h>
+#include <string.h>
+#include <strings.h>
 
 #ifdef DO_MEMDEBUG
 #include <mncommon/memdebug.h>
@@ -16,7 +18,12 @@ MEMDEBUG_DECLARE(mnamqp_spec);
 
 #include "diag.h"
 
-mnhash_t methods;
+/*
+ * dimensions of the method dispatch table, see method_table[]
+ */
+#define AMQP_NCLASSES 6
+#define AMQP_CLASS_ID_MAX AMQP_TX
+#define AMQP_METHOD_ID_MAX 120
 
 
 #define FPACK(ty, name) pack_##ty(&conn->outs, m->name)
@@ -27,9 +34,7 @@ mnhash_t methods;
 NEWDECL(mname)                                                 \
 {                                                              \
     amqp_##mname##_t *m;                                       \
-    if ((m = malloc(sizeof(amqp_##mname##_t))) == NULL) {      \
-        FAIL("malloc");                                        \
-    }                                                          \
+    m = amqp_pool_get(&_methinfo[i].pool);                     \
     m->base.mi = &_methinfo[i];                                \
     __fields                                                   \
     return m;                                                  \
@@ -1368,16 +1373,17 @@ FINI(basic_nack,
 /*
  * registry
  */
-#define MI(id, cls, meth)                              \
-{                                                      \
-    #cls "." #meth,                                    \
-    id,                                                \
-    (amqp_method_new_t)amqp_##cls##_##meth##_new,      \
-    amqp_##cls##_##meth##_str,                         \
-    amqp_##cls##_##meth##_enc,                         \
-    amqp_##cls##_##meth##_dec,                         \
-    amqp_##cls##_##meth##_fini                         \
-}                                                      \
+#define MI(id, cls, meth)                                  \
+{                                                          \
+    #cls "." #meth,                                        \
+    id,                                                    \
+    (amqp_method_new_t)amqp_##cls##_##meth##_new,          \
+    amqp_##cls##_##meth##_str,                             \
+    amqp_##cls##_##meth##_enc,                             \
+    amqp_##cls##_##meth##_dec,                             \
+    amqp_##cls##_##meth##_fini,                            \
+    AMQP_POOL_INITIALIZER(sizeof(amqp_##cls##_##meth##_t)) \
+}                                                          \
 
 
 static amqp_method_info_t _methinfo[] = {
@@ -1446,17 +1452,220 @@ static amqp_method_info_t _methinfo[] = {
 };
 
 
+/*
+ * method info by class and method id: class_index[] maps a class id to
+ * its method_table row + 1, 0 for none, rows are indexed by method id,
+ * each entry points to its method in _methinfo[]
+ */
+#define MT(mid, i) [(mid) & 0xffff] = &_methinfo[i]
+
+static const uint8_t class_index[AMQP_CLASS_ID_MAX + 1] = {
+    [AMQP_CONNECTION] = 1,
+    [AMQP_CHANNEL] = 2,
+    [AMQP_CONFIRM] = 3,
+    [AMQP_EXCHANGE] = 4,
+    [AMQP_QUEUE] = 5,
+    [AMQP_BASIC] = 6,
+};
+
+static amqp_method_info_t * const
+method_table[AMQP_NCLASSES][AMQP_METHOD_ID_MAX + 1] = {
+    {
+        MT(AMQP_CONNECTION_START, 0),
+        MT(AMQP_CONNECTION_START_OK, 1),
+        MT(AMQP_CONNECTION_SECURE, 2),
+        MT(AMQP_CONNECTION_SECURE_OK, 3),
+        MT(AMQP_CONNECTION_TUNE, 4),
+        MT(AMQP_CONNECTION_TUNE_OK, 5),
+        MT(AMQP_CONNECTION_OPEN, 6),
+        MT(AMQP_CONNECTION_OPEN_OK, 7),
+        MT(AMQP_CONNECTION_CLOSE, 8),
+        MT(AMQP_CONNECTION_CLOSE_OK, 9),
+    },
+    {
+        MT(AMQP_CHANNEL_OPEN, 10),
+        MT(AMQP_CHANNEL_OPEN_OK, 11),
+        MT(AMQP_CHANNEL_FLOW, 12),
+        MT(AMQP_CHANNEL_FLOW_OK, 13),
+        MT(AMQP_CHANNEL_CLOSE, 14),
+        MT(AMQP_CHANNEL_CLOSE_OK, 15),
+    },
+    {
+        MT(AMQP_CONFIRM_SELECT, 16),
+        MT(AMQP_CONFIRM_SELECT_OK, 17),
+    },
+    {
+        MT(AMQP_EXCHANGE_DECLARE, 18),
+        MT(AMQP_EXCHANGE_DECLARE_OK, 19),
+        MT(AMQP_EXCHANGE_DELETE, 20),
+        MT(AMQP_EXCHANGE_DELETE_OK, 21),
+    },
+    {
+        MT(AMQP_QUEUE_DECLARE, 22),
+        MT(AMQP_QUEUE_DECLARE_OK, 23),
+        MT(AMQP_QUEUE_BIND, 24),
+        MT(AMQP_QUEUE_BIND_OK, 25),
+        MT(AMQP_QUEUE_PURGE, 26),
+        MT(AMQP_QUEUE_PURGE_OK, 27),
+        MT(AMQP_QUEUE_DELETE, 28),
+        MT(AMQP_QUEUE_DELETE_OK, 29),
+        MT(AMQP_QUEUE_UNBIND, 30),
+        MT(AMQP_QUEUE_UNBIND_OK, 31),
+    },
+    {
+        MT(AMQP_BASIC_QOS, 32),
+        MT(AMQP_BASIC_QOS_OK, 33),
+        MT(AMQP_BASIC_CONSUME, 34),
+        MT(AMQP_BASIC_CONSUME_OK, 35),
+        MT(AMQP_BASIC_CANCEL, 36),
+        MT(AMQP_BASIC_CANCEL_OK, 37),
+        MT(AMQP_BASIC_PUBLISH, 38),
+        MT(AMQP_BASIC_RETURN, 39),
+        MT(AMQP_BASIC_DELIVER, 40),
+        MT(AMQP_BASIC_GET, 41),
+        MT(AMQP_BASIC_GET_OK, 42),
+        MT(AMQP_BASIC_GET_EMPTY, 43),
+        MT(AMQP_BASIC_ACK, 44),
+        MT(AMQP_BASIC_REJECT, 45),
+        MT(AMQP_BASIC_RECOVER_ASYNC, 46),
+        MT(AMQP_BASIC_RECOVER, 47),
+        MT(AMQP_BASIC_RECOVER_OK, 48),
+        MT(AMQP_BASIC_NACK, 49),
+    },
+};
+
+#undef MT
+
+
+static amqp_method_info_t *
+method_info_lookup(amqp_meth_id_t mid)
+{
+    uint64_t cls, meth;
+
+    cls = mid >> 16;
+    meth = mid & 0xffff;
+    if (cls > AMQP_CLASS_ID_MAX ||
+        meth > AMQP_METHOD_ID_MAX ||
+        class_index[cls] == 0) {
+        return NULL;
+    }
+    return method_table[class_index[cls] - 1][meth];
+}
+
+
 amqp_method_info_t *
 amqp_method_info_get(amqp_meth_id_t mid)
 {
-    mnhash_item_t *dit;
-    amqp_method_info_t *mi;
+    return method_info_lookup(mid);
+}
+
+
+/*
+ * Decoders of the hot methods.  Method frames are buffered whole before
+ * they are decoded, so the fields are taken from the input buffer at
+ * once, with no per-field checks for more data.  Short of data, fall
+ * back to the generic decoder.
+ */
+static mnbytes_t *
+shortstr_fast(const char *s, uint8_t sz)
+{
+    mnbytes_t *res;
+
+    res = bytes_new(sz + 1);
+    memcpy(BDATA(res), s, sz);
+    BDATA(res)[sz] = '\0';
+    BYTES_INCREF(res);
+    return res;
+}
+
+
+static uint64_t
+longlong_fast(const char *s)
+{
+    uint64_t v;
+
+    memcpy(&v, s, sizeof(uint64_t));
+    return be64toh(v);
+}
+
+
+static int
+amqp_basic_deliver_dec_fast(amqp_conn_t *conn, amqp_meth_params_t **p)
+{
+    amqp_basic_deliver_t *m;
+    const char *s;
+    ssize_t avail, ctag, ex, rk;
+
+    s = SPDATA(&conn->ins);
+    avail = SAVAIL(&conn->ins);
+
+    /* consumer_tag, delivery_tag, flags, exchange, routing_key */
+    if (avail < 1) {
+        return amqp_basic_deliver_dec(conn, p);
+    }
+    ctag = (uint8_t)s[0];
+    if (avail < 1 + ctag + 8 + 1 + 1) {
+        return amqp_basic_deliver_dec(conn, p);
+    }
+    ex = (uint8_t)s[1 + ctag + 8 + 1];
+    if (avail < 1 + ctag + 8 + 1 + 1 + ex + 1) {
+        return amqp_basic_deliver_dec(conn, p);
+    }
+    rk = (uint8_t)s[1 + ctag + 8 + 1 + 1 + ex];
+    if (avail < 1 + ctag + 8 + 1 + 1 + ex + 1 + rk) {
+        return amqp_basic_deliver_dec(conn, p);
+    }
+
+    m = NEWREF(basic_deliver)();
+    *p = (amqp_meth_params_t *)m;
+    m->consumer_tag = shortstr_fast(s + 1, ctag);
+    s += 1 + ctag;
+    m->delivery_tag = longlong_fast(s);
+    s += 8;
+    m->flags = (uint8_t)*s++;
+    m->exchange = shortstr_fast(s + 1, ex);
+    s += 1 + ex;
+    m->routing_key = shortstr_fast(s + 1, rk);
+    SADVANCEPOS(&conn->ins, 1 + ctag + 8 + 1 + 1 + ex + 1 + rk);
+    return 0;
+}
+
 
-    mi = NULL;
-    if ((dit = hash_get_item(&methods, (void *)(uintptr_t)mid)) != NULL) {
-        mi = dit->value;
+static int
+amqp_basic_ack_dec_fast(amqp_conn_t *conn, amqp_meth_params_t **p)
+{
+    amqp_basic_ack_t *m;
+    const char *s;
+
+    if (SAVAIL(&conn->ins) < 8 + 1) {
+        return amqp_basic_ack_dec(conn, p);
     }
-    return mi;
+    s = SPDATA(&conn->ins);
+    m = NEWREF(basic_ack)();
+    *p = (amqp_meth_params_t *)m;
+    m->delivery_tag = longlong_fast(s);
+    m->flags = (uint8_t)s[8];
+    SADVANCEPOS(&conn->ins, 8 + 1);
+    return 0;
+}
+
+
+static int
+amqp_basic_nack_dec_fast(amqp_conn_t *conn, amqp_meth_params_t **p)
+{
+    amqp_basic_nack_t *m;
+    const char *s;
+
+    if (SAVAIL(&conn->ins) < 8 + 1) {
+        return amqp_basic_nack_dec(conn, p);
+    }
+    s = SPDATA(&conn->ins);
+    m = NEWREF(basic_nack)();
+    *p = (amqp_meth_params_t *)m;
+    m->delivery_tag = longlong_fast(s);
+    m->flags = (uint8_t)s[8];
+    SADVANCEPOS(&conn->ins, 8 + 1);
+    return 0;
 }
 
 
@@ -1466,16 +1675,29 @@ amqp_meth_params_decode(amqp_conn_t *conn,
                         amqp_meth_params_t **params)
 {
     int res;
-    mnhash_item_t *dit;
     amqp_method_info_t *mi;
 
-    if ((dit = hash_get_item(&methods, (void *)(uintptr_t)mid)) == NULL) {
+    if ((mi = method_info_lookup(mid)) == NULL) {
         TRACE("invalid mid %016lx", mid);
         TRRET(AMQP_METH_PARAMS_DECODE + 1);
     }
-    mi = dit->value;
     assert(mi->mid == mid);
-    res =  mi->dec(conn, params);
+    switch (mid) {
+    case AMQP_BASIC_DELIVER:
+        res = amqp_basic_deliver_dec_fast(conn, params);
+        break;
+
+    case AMQP_BASIC_ACK:
+        res = amqp_basic_ack_dec_fast(conn, params);
+        break;
+
+    case AMQP_BASIC_NACK:
+        res = amqp_basic_nack_dec_fast(conn, params);
+        break;
+
+    default:
+        res = mi->dec(conn, params);
+    }
     (*params)->mi = mi;
     return res;
 }
@@ -1498,25 +1720,12 @@ amqp_meth_params_destroy(amqp_meth_params_t **params)
     if (*params != NULL) {
         assert((*params)->mi != NULL);
         (*params)->mi->fini(*params);
-        free(*params);
+        amqp_pool_put(&(*params)->mi->pool, *params);
         *params = NULL;
     }
 }
 
 
-static uint64_t
-method_info_hash(const void *mid)
-{
-    return (amqp_meth_id_t)mid;
-}
-
-static int
-method_info_cmp(const void *a, const void *b)
-{
-    return (int)(int64_t)(a - b);
-}
-
-
 /*
  * header
  */
@@ -1526,9 +1735,7 @@ amqp_header_new(void)
 {
     amqp_header_t *header;
 
-    if ((header=  malloc(sizeof(amqp_header_t))) == NULL) {
-        FAIL("malloc");
-    }
+    header = amqp_pool_get(&amqp_header_pool);
     header->class_id = 0;
     header->weight = 0;
     header->body_size = 0ll;
@@ -1612,7 +1819,7 @@ amqp_header_destroy(amqp_header_t **header)
         BYTES_DECREF(&(*header)->user_id);
         BYTES_DECREF(&(*header)->app_id);
         BYTES_DECREF(&(*header)->cluster_id);
-        free(*header);
+        amqp_pool_put(&amqp_header_pool, *header);
     }
 }
 
@@ -1675,8 +1882,51 @@ amqp_header_enc(amqp_header_t *m, struct _amqp_conn *conn)
     FPACK(short, class_id);
     FPACK(short, weight);
     FPACK(longlong, body_size);
-    FPACK(short, flags);
+    amqp_header_enc_props(m, &conn->outs);
+    return 0;
+}
+
+
+#undef FPACK
+#undef FPACKA
+#undef FHPACK
+#undef FHPACKA
+#define FPACK(ty, name) pack_##ty(bs, m->name)
+#define FPACKA(ty, name) pack_##ty(bs, &m->name)
+
+#define FHSPAN(f, seod)                                        \
+if (spans != NULL) {                                           \
+    AMQP_HEADER_SPAN(spans, AMQP_HEADER_F##f).off = seod;      \
+    AMQP_HEADER_SPAN(spans, AMQP_HEADER_F##f).sz =             \
+        SEOD(bs) - seod;                                       \
+}                                                              \
+
+
+#define FHPACK(f, ty, n) if (m->flags & AMQP_HEADER_F##f)      \
+{                                                              \
+    off_t seod = SEOD(bs);                                     \
+    FPACK(ty, n);                                              \
+    FHSPAN(f, seod);                                           \
+}                                                              \
+
 
+#define FHPACKA(f, ty, n) if (m->flags & AMQP_HEADER_F##f)     \
+{                                                              \
+    off_t seod = SEOD(bs);                                     \
+    FPACKA(ty, n);                                             \
+    FHSPAN(f, seod);                                           \
+}                                                              \
+
+
+/*
+ * properties without the flags, where each of them went is recorded in
+ * spans unless it is NULL
+ */
+static void
+header_enc_spans(amqp_header_t *m,
+                 mnbytestream_t *bs,
+                 amqp_header_span_t *spans)
+{
     FHPACK(CONTENT_TYPE, shortstr, content_type);
     FHPACK(CONTENT_ENCODING, shortstr, content_encoding);
     FHPACKA(HEADERS, table, headers);
@@ -1691,8 +1941,18 @@ amqp_header_enc(amqp_header_t *m, struct _amqp_conn *conn)
     FHPACK(USER_ID, shortstr, user_id);
     FHPACK(APP_ID, shortstr, app_id);
     FHPACK(CLUSTER_ID, shortstr, cluster_id);
+}
 
-    return 0;
+
+/*
+ * property flags and properties, the part of a content header that does
+ * not depend on the body, see also amqp_publish_template_new()
+ */
+void
+amqp_header_enc_props(amqp_header_t *m, mnbytestream_t *bs)
+{
+    FPACK(short, flags);
+    header_enc_spans(m, bs, NULL);
 }
 
 #define AMQP_HEADER_SET(n, f, ty)                      \
@@ -1766,27 +2026,153 @@ AMQP_HEADER_SETB(app_id, APP_ID)
 AMQP_HEADER_SETB(cluster_id, CLUSTER_ID)
 
 
+/*
+ * header builder
+ */
+void
+amqp_header_builder_init(amqp_header_builder_t *hb, amqp_header_t *statics)
+{
+    bytestream_init(&hb->statics, 256);
+    bytestream_init(&hb->msg, 256);
+    memset(hb->spans, '\0', sizeof(hb->spans));
+    memset(hb->msg_spans, '\0', sizeof(hb->msg_spans));
+    hb->static_flags = 0;
+    hb->msg_flags = 0;
+    if (statics != NULL) {
+        header_enc_spans(statics, &hb->statics, hb->spans);
+        hb->static_flags = statics->flags;
+    }
+}
+
+
+void
+amqp_header_builder_fini(amqp_header_builder_t *hb)
+{
+    bytestream_fini(&hb->statics);
+    bytestream_fini(&hb->msg);
+}
+
+
+/*
+ * forget per-message properties, static ones are kept
+ */
+void
+amqp_header_builder_reset(amqp_header_builder_t *hb)
+{
+    bytestream_rewind(&hb->msg);
+    hb->msg_flags = 0;
+}
+
+
+size_t
+amqp_header_builder_size(amqp_header_builder_t *hb)
+{
+    size_t res;
+    int i;
+
+    res = sizeof(uint16_t);
+    for (i = 15; i >= 0; --i) {
+        if (hb->msg_flags & (1 << i)) {
+            res += hb->msg_spans[i].sz;
+        } else if (hb->static_flags & (1 << i)) {
+            res += hb->spans[i].sz;
+        }
+    }
+    return res;
+}
+
+
+/*
+ * flags and properties in flag order, per-message properties take
+ * precedence over static ones, buf is amqp_header_builder_size() long
+ */
+void
+amqp_header_builder_copy(amqp_header_builder_t *hb, char *buf)
+{
+    uint16_t flags;
+    int i;
+
+    flags = htobe16(hb->static_flags | hb->msg_flags);
+    memcpy(buf, &flags, sizeof(flags));
+    buf += sizeof(flags);
+    for (i = 15; i >= 0; --i) {
+        if (hb->msg_flags & (1 << i)) {
+            memcpy(buf,
+                   SDATA(&hb->msg, hb->msg_spans[i].off),
+                   hb->msg_spans[i].sz);
+            buf += hb->msg_spans[i].sz;
+        } else if (hb->static_flags & (1 << i)) {
+            memcpy(buf,
+                   SDATA(&hb->statics, hb->spans[i].off),
+                   hb->spans[i].sz);
+            buf += hb->spans[i].sz;
+        }
+    }
+}
+
+
+/*
+ * a property set again is appended anew, the stale encoding stays in msg
+ * until amqp_header_builder_reset()
+ */
+#define AMQP_HEADER_BUILDER_SET(n, f, ty, pty)                 \
+AMQP_HEADER_BUILDER_SET_DECL(n, ty)                            \
+{                                                              \
+    amqp_header_span_t *span;                                  \
+    off_t seod;                                                \
+    span = &AMQP_HEADER_SPAN(hb->msg_spans, AMQP_HEADER_F##f); \
+    seod = SEOD(&hb->msg);                                     \
+    pack_##pty(&hb->msg, v);                                   \
+    span->off = seod;                                          \
+    span->sz = SEOD(&hb->msg) - seod;                          \
+    hb->msg_flags |= AMQP_HEADER_F##f;                         \
+}                                                              \
+
+
+AMQP_HEADER_BUILDER_SET(correlation_id, CORRELATION_ID, mnbytes_t *, shortstr)
+
+AMQP_HEADER_BUILDER_SET(reply_to, REPLY_TO, mnbytes_t *, shortstr)
+
+AMQP_HEADER_BUILDER_SET(expiration, EXPIRATION, mnbytes_t *, shortstr)
+
+AMQP_HEADER_BUILDER_SET(message_id, MESSAGE_ID, mnbytes_t *, shortstr)
+
+AMQP_HEADER_BUILDER_SET(timestamp, TIMESTAMP, uint64_t, longlong)
+
+AMQP_HEADER_BUILDER_SET(type, TYPE, mnbytes_t *, shortstr)
+
+
 void
 amqp_spec_init(void)
 {
+#ifndef NDEBUG
     size_t i;
 
-    hash_init(&methods, 101,
-              (hash_hashfn_t)method_info_hash,
-              (hash_item_comparator_t)method_info_cmp,
-              NULL);
-
+    /* method_table[] is kept in step with _methinfo[] by hand */
     for (i = 0; i < countof(_methinfo); ++i) {
-        amqp_method_info_t *mi;
-
-        mi = &_methinfo[i];
-        hash_set_item(&methods, (void *)(uintptr_t)mi->mid, mi);
+        assert(method_info_lookup(_methinfo[i].mid) == &_methinfo[i]);
     }
+#endif
 }
 
 
 void
 amqp_spec_fini(void)
 {
-    hash_fini(&methods);
+    size_t i;
+
+    for (i = 0; i < countof(_methinfo); ++i) {
+        amqp_pool_fini(&_methinfo[i].pool);
+    }
+}
+
+
+void
+amqp_spec_pool_stats(amqp_pool_stats_t *stats)
+{
+    size_t i;
+
+    for (i = 0; i < countof(_methinfo); ++i) {
+        amqp_pool_stats_add(&_methinfo[i].pool, stats);
+    }
 }
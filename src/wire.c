@@ -1113,11 +1113,16 @@ mnamqp_init(void)
         ty->kill = _typeinfo[i].kill;
     }
     amqp_spec_init();
+    amqp_memory_init();
 }
 
 
 void
 mnamqp_fini(void)
 {
+    amqp_memory_fini();
     amqp_spec_fini();
+    amqp_pool_fini(&amqp_frame_pool);
+    amqp_pool_fini(&amqp_header_pool);
+    amqp_pool_fini(&amqp_pending_content_pool);
 }
@@ -0,0 +1,26 @@
+#include <stddef.h>
+#include <time.h>
+
+#include "mybench.h"
+
+/*
+ * monotonic clock for the microbenchmarks
+ */
+uint64_t
+mybench_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+
+/*
+ * nanoseconds per operation from t0 to t1
+ */
+double
+mybench_per(uint64_t t0, uint64_t t1, size_t n)
+{
+    return (double)(t1 - t0) / (double)n;
+}
@@ -0,0 +1,17 @@
+#ifndef MYBENCH_H_DEFINED
+#define MYBENCH_H_DEFINED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+uint64_t mybench_nsec(void);
+double mybench_per(uint64_t, uint64_t, size_t);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
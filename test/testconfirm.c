@@ -0,0 +1,350 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <time.h>
+
+#ifdef DO_MEMDEBUG
+#include <mncommon/memdebug.h>
+MEMDEBUG_DECLARE(mnamqp_testconfirm);
+#endif
+
+#include <mncommon/dumpm.h>
+
+#include <mnamqp_private.h>
+
+#include "diag.h"
+
+#include "unittest.h"
+#include "mybench.h"
+
+#ifndef NDEBUG
+const char *_malloc_options = "AJ";
+#endif
+
+/*
+ * Publisher confirm tracker, no broker needed: the order publishes are
+ * settled in, then a microbenchmark registering n outstanding publishes
+ * and settling them in order, out of order, and with multiple acks.
+ */
+
+#define NPUBLISHES 8
+#define NSETTLED 16
+
+static size_t nsettled;
+
+/* settled tags and whether their publisher was still waiting */
+static struct {
+    uint64_t tag;
+    int waiting;
+} settled[NSETTLED];
+static int recording;
+
+
+static void
+settle_cb(amqp_confirm_slot_t *slot,
+          uint64_t tag,
+          UNUSED int status,
+          UNUSED void *udata)
+{
+    if (recording) {
+        if (nsettled >= countof(settled)) {
+            FAIL("settle_cb");
+        }
+        settled[nsettled].tag = tag;
+        settled[nsettled].waiting = slot->pp != NULL;
+    }
+    ++nsettled;
+}
+
+
+/*
+ * expected is zero terminated, negative for the tags nobody waits for
+ */
+static void
+check_settled(const char *name, const int64_t *expected)
+{
+    size_t i;
+
+    for (i = 0; i < nsettled; ++i) {
+        int64_t tag;
+
+        tag = settled[i].waiting ?
+            (int64_t)settled[i].tag :
+            -(int64_t)settled[i].tag;
+        if (tag != expected[i]) {
+            TRACE("%s: settled %zd: %"PRId64", expected %"PRId64,
+                  name,
+                  i,
+                  tag,
+                  expected[i]);
+            FAIL(name);
+        }
+    }
+    if (expected[nsettled] != 0) {
+        TRACE("%s: %zd settled, expected more", name, nsettled);
+        FAIL(name);
+    }
+}
+
+
+/*
+ * Acks, nacks and publishers giving up, against NPUBLISHES tags: a
+ * negative tag forgets it, multiple acks settle everything up to theirs.
+ */
+static void
+test_settle(void)
+{
+    struct {
+        long rnd;
+        struct {
+            int64_t tag;
+            int multiple;
+        } ops[NSETTLED];
+        int64_t expected[NSETTLED];
+        uint64_t oldest;
+    } data[] = {
+        {0, {{1, 0}, {2, 0}, {3, 0}, {0, 0}}, {1, 2, 3, 0}, 4},
+        {0, {{3, 0}, {1, 0}, {2, 0}, {0, 0}}, {3, 1, 2, 0}, 4},
+        {0, {{5, 1}, {0, 0}}, {1, 2, 3, 4, 5, 0}, 6},
+        {0, {{2, 0}, {4, 1}, {0, 0}}, {2, 1, 3, 4, 0}, 5},
+        {0, {{8, 1}, {0, 0}}, {1, 2, 3, 4, 5, 6, 7, 8, 0}, 0},
+        /* settled twice, or never published */
+        {0, {{2, 0}, {2, 0}, {2, 1}, {9, 0}, {9, 1}, {0, 0}},
+            {2, 1, 0}, 3},
+        {0, {{-2, 0}, {-3, 0}, {3, 1}, {0, 0}}, {1, -2, -3, 0}, 4},
+        {0, {{-1, 0}, {1, 0}, {-1, 0}, {0, 0}}, {-1, 0}, 2},
+        /* forgetting settled or unknown tags is a no-op */
+        {0, {{1, 0}, {-1, 0}, {-9, 0}, {2, 1}, {0, 0}}, {1, 2, 0}, 3},
+    };
+    UNITTEST_PROLOG;
+
+    FOREACHDATA {
+        amqp_confirm_tracker_t tr;
+        uint64_t tag, oldest;
+        unsigned j;
+
+        amqp_confirm_tracker_init(&tr);
+        for (tag = 1; tag <= NPUBLISHES; ++tag) {
+            /* never dereferenced */
+            (void)amqp_confirm_tracker_add(&tr,
+                                           (amqp_pending_pub_t *)&tr,
+                                           0);
+        }
+        nsettled = 0;
+        recording = 1;
+        for (j = 0; CDATA.ops[j].tag != 0; ++j) {
+            if (CDATA.ops[j].tag < 0) {
+                amqp_confirm_tracker_forget(&tr, -CDATA.ops[j].tag);
+            } else {
+                (void)amqp_confirm_tracker_settle(&tr,
+                                                  CDATA.ops[j].tag,
+                                                  CDATA.ops[j].multiple,
+                                                  0,
+                                                  settle_cb,
+                                                  NULL);
+            }
+        }
+        recording = 0;
+        check_settled("test_settle", CDATA.expected);
+        oldest = 0;
+        (void)amqp_confirm_tracker_oldest(&tr, &oldest);
+        if (oldest != CDATA.oldest) {
+            TRACE("oldest %"PRIu64" expected %"PRIu64, oldest, CDATA.oldest);
+            FAIL("test_settle oldest");
+        }
+        if (tr.npending != NPUBLISHES - nsettled) {
+            FAIL("test_settle npending");
+        }
+        amqp_confirm_tracker_fini(&tr);
+    }
+}
+
+
+/*
+ * The ring grows while wrapped around: tags keep their slots.
+ */
+static void
+test_grow(void)
+{
+    amqp_confirm_tracker_t tr;
+    uint64_t tag, oldest;
+    size_t sz;
+
+    amqp_confirm_tracker_init(&tr);
+    sz = tr.sz;
+    for (tag = 1; tag <= sz; ++tag) {
+        (void)amqp_confirm_tracker_add(&tr, NULL, tag);
+    }
+    (void)amqp_confirm_tracker_settle(&tr, sz / 2, 1, 0, NULL, NULL);
+    for (; tag <= sz * 2; ++tag) {
+        (void)amqp_confirm_tracker_add(&tr, NULL, tag);
+    }
+    if (tr.sz <= sz) {
+        FAIL("test_grow sz");
+    }
+    for (tag = sz / 2 + 1; tag <= sz * 2; ++tag) {
+        amqp_confirm_slot_t *slot;
+
+        if ((slot = amqp_confirm_tracker_oldest(&tr, &oldest)) == NULL ||
+            oldest != tag ||
+            slot->ts != tag) {
+            TRACE("tag %"PRIu64, tag);
+            FAIL("test_grow");
+        }
+        (void)amqp_confirm_tracker_settle(&tr, tag, 0, 0, NULL, NULL);
+    }
+    if (amqp_confirm_tracker_oldest(&tr, NULL) != NULL || tr.npending != 0) {
+        FAIL("test_grow npending");
+    }
+    amqp_confirm_tracker_fini(&tr);
+}
+
+
+static void
+fill(amqp_confirm_tracker_t *tr, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; ++i) {
+        (void)amqp_confirm_tracker_add(tr, NULL, i);
+    }
+}
+
+
+static void
+report(const char *name, size_t n, uint64_t t0)
+{
+    uint64_t t1;
+
+    t1 = mybench_nsec();
+    if (nsettled != n) {
+        FAIL(name);
+    }
+    TRACE("%-10s n=%-7zd %8.2f ns/confirm",
+          name,
+          n,
+          mybench_per(t0, t1, n));
+}
+
+
+static void
+bench_inorder(size_t n)
+{
+    amqp_confirm_tracker_t tr;
+    uint64_t t0, tag;
+
+    amqp_confirm_tracker_init(&tr);
+    fill(&tr, n);
+    nsettled = 0;
+    t0 = mybench_nsec();
+    for (tag = 1; tag <= n; ++tag) {
+        (void)amqp_confirm_tracker_settle(&tr, tag, 0, 0, settle_cb, NULL);
+    }
+    report("inorder", n, t0);
+    if (amqp_confirm_tracker_oldest(&tr, NULL) != NULL) {
+        FAIL("oldest");
+    }
+    amqp_confirm_tracker_fini(&tr);
+}
+
+
+static void
+bench_reverse(size_t n)
+{
+    amqp_confirm_tracker_t tr;
+    uint64_t t0, tag;
+
+    amqp_confirm_tracker_init(&tr);
+    fill(&tr, n);
+    nsettled = 0;
+    t0 = mybench_nsec();
+    for (tag = n; tag >= 1; --tag) {
+        (void)amqp_confirm_tracker_settle(&tr, tag, 0, 0, settle_cb, NULL);
+    }
+    report("reverse", n, t0);
+    if (amqp_confirm_tracker_oldest(&tr, NULL) != NULL) {
+        FAIL("oldest");
+    }
+    amqp_confirm_tracker_fini(&tr);
+}
+
+
+static void
+bench_random(size_t n)
+{
+    amqp_confirm_tracker_t tr;
+    uint64_t *tags;
+    uint64_t t0;
+    size_t i;
+
+    if ((tags = malloc(sizeof(uint64_t) * n)) == NULL) {
+        FAIL("malloc");
+    }
+    for (i = 0; i < n; ++i) {
+        tags[i] = i + 1;
+    }
+    for (i = n - 1; i > 0; --i) {
+        size_t j;
+        uint64_t tmp;
+
+        j = random() % (i + 1);
+        tmp = tags[i];
+        tags[i] = tags[j];
+        tags[j] = tmp;
+    }
+
+    amqp_confirm_tracker_init(&tr);
+    fill(&tr, n);
+    nsettled = 0;
+    t0 = mybench_nsec();
+    for (i = 0; i < n; ++i) {
+        (void)amqp_confirm_tracker_settle(&tr, tags[i], 0, 0, settle_cb, NULL);
+    }
+    report("random", n, t0);
+    if (amqp_confirm_tracker_oldest(&tr, NULL) != NULL) {
+        FAIL("oldest");
+    }
+    amqp_confirm_tracker_fini(&tr);
+    free(tags);
+}
+
+
+static void
+bench_multiple(size_t n)
+{
+    amqp_confirm_tracker_t tr;
+    uint64_t t0, tag;
+
+    amqp_confirm_tracker_init(&tr);
+    fill(&tr, n);
+    nsettled = 0;
+    t0 = mybench_nsec();
+    for (tag = 64; tag < n; tag += 64) {
+        (void)amqp_confirm_tracker_settle(&tr, tag, 1, 0, settle_cb, NULL);
+    }
+    (void)amqp_confirm_tracker_settle(&tr, n, 1, 0, settle_cb, NULL);
+    report("multiple", n, t0);
+    if (amqp_confirm_tracker_oldest(&tr, NULL) != NULL) {
+        FAIL("oldest");
+    }
+    amqp_confirm_tracker_fini(&tr);
+}
+
+
+int
+main(void)
+{
+    size_t sizes[] = {1000, 10000, 100000};
+    unsigned i;
+
+    test_settle();
+    test_grow();
+
+    srandom(time(NULL));
+    for (i = 0; i < countof(sizes); ++i) {
+        bench_inorder(sizes[i]);
+        bench_reverse(sizes[i]);
+        bench_random(sizes[i]);
+        bench_multiple(sizes[i]);
+    }
+    return 0;
+}
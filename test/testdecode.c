@@ -0,0 +1,278 @@
+#include <assert.h>
+#include <inttypes.h>
+
+#ifdef DO_MEMDEBUG
+#include <mncommon/memdebug.h>
+MEMDEBUG_DECLARE(mnamqp_testdecode);
+#endif
+
+#include <mncommon/bytestream.h>
+#include <mncommon/hash.h>
+#include <mncommon/dumpm.h>
+
+#include <mnamqp_private.h>
+
+#include "diag.h"
+
+#include "unittest.h"
+#include "mybench.h"
+
+#ifndef NDEBUG
+const char *_malloc_options = "AJ";
+#endif
+
+/*
+ * Method decode microbenchmark, no broker needed: the hash lookup and
+ * the generic decoders in the method info, as used before, against the
+ * dispatch table and the fast decoders of the hot methods.  Both are
+ * first checked to decode what was encoded.
+ */
+
+#define NITER 1000000
+
+typedef int (*params_cmp_t)(amqp_meth_params_t *, amqp_meth_params_t *);
+
+static mnhash_t methods;
+
+
+static uint64_t
+method_info_hash(const void *mid)
+{
+    return (amqp_meth_id_t)mid;
+}
+
+
+static int
+method_info_cmp(const void *a, const void *b)
+{
+    return (int)(int64_t)(a - b);
+}
+
+
+static void
+encode(amqp_conn_t *conn,
+       amqp_meth_params_t *params,
+       mnbytestream_t *bs)
+{
+    bytestream_rewind(&conn->outs);
+    params->mi->enc(params, conn);
+    bytestream_rewind(bs);
+    (void)bytestream_cat(bs, SEOD(&conn->outs), SDATA(&conn->outs, 0));
+}
+
+
+static void
+refill(amqp_conn_t *conn, mnbytestream_t *bs)
+{
+    bytestream_rewind(&conn->ins);
+    (void)bytestream_cat(&conn->ins, SEOD(bs), SDATA(bs, 0));
+}
+
+
+static int
+bytes_eq(mnbytes_t *a, mnbytes_t *b)
+{
+    if (a == NULL || b == NULL) {
+        return a == b;
+    }
+    return bytes_cmp(a, b) == 0;
+}
+
+
+static int
+basic_deliver_cmp(amqp_meth_params_t *a, amqp_meth_params_t *b)
+{
+    amqp_basic_deliver_t *ma, *mb;
+
+    ma = (amqp_basic_deliver_t *)a;
+    mb = (amqp_basic_deliver_t *)b;
+    return bytes_eq(ma->consumer_tag, mb->consumer_tag) &&
+        ma->delivery_tag == mb->delivery_tag &&
+        ma->flags == mb->flags &&
+        bytes_eq(ma->exchange, mb->exchange) &&
+        bytes_eq(ma->routing_key, mb->routing_key);
+}
+
+
+static int
+basic_ack_cmp(amqp_meth_params_t *a, amqp_meth_params_t *b)
+{
+    amqp_basic_ack_t *ma, *mb;
+
+    ma = (amqp_basic_ack_t *)a;
+    mb = (amqp_basic_ack_t *)b;
+    return ma->delivery_tag == mb->delivery_tag && ma->flags == mb->flags;
+}
+
+
+static int
+basic_nack_cmp(amqp_meth_params_t *a, amqp_meth_params_t *b)
+{
+    amqp_basic_nack_t *ma, *mb;
+
+    ma = (amqp_basic_nack_t *)a;
+    mb = (amqp_basic_nack_t *)b;
+    return ma->delivery_tag == mb->delivery_tag && ma->flags == mb->flags;
+}
+
+
+/*
+ * both decoders give back what was encoded, and consume all of it
+ */
+static void
+check(amqp_conn_t *conn,
+      const char *name,
+      amqp_meth_id_t mid,
+      amqp_meth_params_t *orig,
+      params_cmp_t cmp,
+      mnbytestream_t *bs)
+{
+    amqp_meth_params_t *params;
+
+    refill(conn, bs);
+    params = NULL;
+    if (orig->mi->dec(conn, &params) != 0 || params == NULL) {
+        FAIL(name);
+    }
+    params->mi = orig->mi;
+    if (!cmp(orig, params) || SPOS(&conn->ins) != SEOD(&conn->ins)) {
+        TRACE("%s: generic decoder mismatch", name);
+        FAIL(name);
+    }
+    amqp_meth_params_destroy(&params);
+
+    refill(conn, bs);
+    params = NULL;
+    if (amqp_meth_params_decode(conn, mid, &params) != 0 || params == NULL) {
+        FAIL(name);
+    }
+    if (params->mi != orig->mi ||
+        !cmp(orig, params) ||
+        SPOS(&conn->ins) != SEOD(&conn->ins)) {
+        TRACE("%s: fast decoder mismatch", name);
+        FAIL(name);
+    }
+    amqp_meth_params_destroy(&params);
+}
+
+
+static void
+bench(amqp_conn_t *conn,
+      const char *name,
+      amqp_meth_id_t mid,
+      mnbytestream_t *bs)
+{
+    uint64_t t0, t1, t2;
+    int i;
+
+    t0 = mybench_nsec();
+    for (i = 0; i < NITER; ++i) {
+        mnhash_item_t *dit;
+        amqp_meth_params_t *params;
+
+        refill(conn, bs);
+        if ((dit = hash_get_item(&methods,
+                                 (void *)(uintptr_t)mid)) == NULL) {
+            FAIL("hash_get_item");
+        }
+        if (((amqp_method_info_t *)dit->value)->dec(conn, &params) != 0) {
+            FAIL("dec");
+        }
+        params->mi = dit->value;
+        amqp_meth_params_destroy(&params);
+    }
+    t1 = mybench_nsec();
+    for (i = 0; i < NITER; ++i) {
+        amqp_meth_params_t *params;
+
+        refill(conn, bs);
+        if (amqp_meth_params_decode(conn, mid, &params) != 0) {
+            FAIL("amqp_meth_params_decode");
+        }
+        amqp_meth_params_destroy(&params);
+    }
+    t2 = mybench_nsec();
+
+    TRACE("%-14s hash+generic %7.2f ns  table+fast %7.2f ns",
+          name,
+          mybench_per(t0, t1, NITER),
+          mybench_per(t1, t2, NITER));
+}
+
+
+int
+main(void)
+{
+    amqp_conn_t *conn;
+    mnbytestream_t bs;
+    amqp_meth_id_t mids[] = {
+        AMQP_BASIC_DELIVER,
+        AMQP_BASIC_ACK,
+        AMQP_BASIC_NACK,
+    };
+    unsigned i;
+
+    mnamqp_init();
+    conn = amqp_conn_new("localhost", 5672, "guest", "guest", "/",
+                         0, 0, 0, 0);
+    bytestream_init(&bs, 1024);
+
+    hash_init(&methods, 101,
+              (hash_hashfn_t)method_info_hash,
+              (hash_item_comparator_t)method_info_cmp,
+              NULL);
+    for (i = 0; i < countof(mids); ++i) {
+        hash_set_item(&methods,
+                      (void *)(uintptr_t)mids[i],
+                      amqp_method_info_get(mids[i]));
+    }
+
+    {
+        amqp_basic_deliver_t *m;
+
+        m = NEWREF(basic_deliver)();
+        m->consumer_tag = bytes_new_from_str("amq.ctag-0123456789abcdef");
+        BYTES_INCREF(m->consumer_tag);
+        m->delivery_tag = 123456789;
+        m->flags = 0x01; /* redelivered */
+        m->exchange = bytes_new_from_str("events");
+        BYTES_INCREF(m->exchange);
+        m->routing_key = bytes_new_from_str("events.user.login");
+        BYTES_INCREF(m->routing_key);
+        encode(conn, (amqp_meth_params_t *)m, &bs);
+        check(conn, "basic.deliver", AMQP_BASIC_DELIVER,
+              (amqp_meth_params_t *)m, basic_deliver_cmp, &bs);
+        amqp_meth_params_destroy((amqp_meth_params_t **)&m);
+        bench(conn, "basic.deliver", AMQP_BASIC_DELIVER, &bs);
+    }
+    {
+        amqp_basic_ack_t *m;
+
+        m = NEWREF(basic_ack)();
+        m->delivery_tag = 123456789;
+        m->flags = ACK_MULTIPLE;
+        encode(conn, (amqp_meth_params_t *)m, &bs);
+        check(conn, "basic.ack", AMQP_BASIC_ACK,
+              (amqp_meth_params_t *)m, basic_ack_cmp, &bs);
+        amqp_meth_params_destroy((amqp_meth_params_t **)&m);
+        bench(conn, "basic.ack", AMQP_BASIC_ACK, &bs);
+    }
+    {
+        amqp_basic_nack_t *m;
+
+        m = NEWREF(basic_nack)();
+        m->delivery_tag = 123456789;
+        m->flags = ACK_MULTIPLE | NACK_REQUEUE;
+        encode(conn, (amqp_meth_params_t *)m, &bs);
+        check(conn, "basic.nack", AMQP_BASIC_NACK,
+              (amqp_meth_params_t *)m, basic_nack_cmp, &bs);
+        amqp_meth_params_destroy((amqp_meth_params_t **)&m);
+        bench(conn, "basic.nack", AMQP_BASIC_NACK, &bs);
+    }
+
+    hash_fini(&methods);
+    bytestream_fini(&bs);
+    amqp_conn_destroy(&conn);
+    mnamqp_fini();
+    return 0;
+}
@@ -0,0 +1,316 @@
+#include <assert.h>
+#include <inttypes.h>
+
+#ifdef DO_MEMDEBUG
+#include <mncommon/memdebug.h>
+MEMDEBUG_DECLARE(mnamqp_testdelivery);
+#endif
+
+#include <mncommon/dumpm.h>
+
+#include <mnamqp_private.h>
+
+#include "diag.h"
+
+#include "unittest.h"
+
+#ifndef NDEBUG
+const char *_malloc_options = "AJ";
+#endif
+
+/*
+ * Consumer delivery tracker, no broker needed: the basic.acks passed for
+ * a sequence of completions, coalesced, flushed, over skipped tags, and
+ * across the ring growing, or not growing for no-ack deliveries.
+ */
+
+#define NDELIVERIES 8
+#define NACKS 16
+
+typedef struct _ack {
+    uint64_t tag;
+    size_t n;
+} ack_t;
+
+static ack_t acks[NACKS];
+static size_t nacks;
+
+
+static void
+ack_cb(uint64_t tag, size_t n, UNUSED void *udata)
+{
+    if (nacks >= countof(acks)) {
+        FAIL("ack_cb");
+    }
+    acks[nacks].tag = tag;
+    acks[nacks].n = n;
+    ++nacks;
+}
+
+
+static void
+check_acks(const char *name, const ack_t *expected)
+{
+    size_t i;
+
+    for (i = 0; i < nacks; ++i) {
+        if (acks[i].tag != expected[i].tag || acks[i].n != expected[i].n) {
+            TRACE("%s: ack %zd: tag %"PRIu64" n %zd, expected "
+                  "tag %"PRIu64" n %zd",
+                  name,
+                  i,
+                  acks[i].tag,
+                  acks[i].n,
+                  expected[i].tag,
+                  expected[i].n);
+            FAIL(name);
+        }
+    }
+    if (expected[nacks].tag != 0) {
+        TRACE("%s: %zd acks, expected more", name, nacks);
+        FAIL(name);
+    }
+}
+
+
+/*
+ * Completions in a worker pool with no ack holding: each one is collected
+ * with flush as soon as it is acked, as in channel_acks_due().
+ */
+static void
+test_pool(void)
+{
+    struct {
+        long rnd;
+        uint64_t completed[NDELIVERIES + 1];
+        ack_t expected[NACKS];
+    } data[] = {
+        {0, {1, 2, 3, 4, 0}, {{1, 1}, {2, 1}, {3, 1}, {4, 1}, {0, 0}}},
+        {0, {2, 3, 1, 4, 0}, {{2, 1}, {3, 1}, {1, 1}, {4, 1}, {0, 0}}},
+        {0, {4, 3, 2, 1, 0}, {{4, 1}, {3, 1}, {2, 1}, {1, 1}, {0, 0}}},
+        /* 1 is stuck in a worker, the rest must not wait for it */
+        {0, {8, 2, 7, 3, 0}, {{8, 1}, {2, 1}, {7, 1}, {3, 1}, {0, 0}}},
+    };
+    UNITTEST_PROLOG;
+
+    FOREACHDATA {
+        amqp_delivery_tracker_t tr;
+        uint64_t tag;
+        unsigned j;
+
+        amqp_delivery_tracker_init(&tr);
+        for (tag = 1; tag <= NDELIVERIES; ++tag) {
+            amqp_delivery_tracker_add(&tr, tag, 0);
+        }
+        nacks = 0;
+        for (j = 0; CDATA.completed[j] != 0; ++j) {
+            if (amqp_delivery_tracker_ack(&tr, CDATA.completed[j], 0) != 0) {
+                FAIL("amqp_delivery_tracker_ack");
+            }
+            (void)amqp_delivery_tracker_collect(&tr, 1, ack_cb, NULL);
+        }
+        check_acks("test_pool", CDATA.expected);
+        if (tr.nready != 0) {
+            FAIL("test_pool nready");
+        }
+        amqp_delivery_tracker_fini(&tr);
+    }
+}
+
+
+/*
+ * Completions held until one collect: positive tags are acked, negative
+ * ones settled by a nack.  Runs from base go out as one multiple ack,
+ * what is acked past an unsettled delivery only if flush.
+ */
+static void
+test_batch(void)
+{
+    struct {
+        long rnd;
+        int64_t completed[NDELIVERIES + 1];
+        int flush;
+        ack_t expected[NACKS];
+        size_t nready;
+    } data[] = {
+        {0, {1, 2, 3, 4, 0}, 0, {{4, 4}, {0, 0}}, 0},
+        {0, {4, 3, 2, 1, 0}, 0, {{4, 4}, {0, 0}}, 0},
+        {0, {2, 3, 0}, 0, {{0, 0}}, 2},
+        {0, {2, 3, 0}, 1, {{2, 1}, {3, 1}, {0, 0}}, 0},
+        /* nacked deliveries are settled, but not counted */
+        {0, {2, 3, -1, 0}, 0, {{3, 2}, {0, 0}}, 0},
+        {0, {-1, -2, 0}, 0, {{0, 0}}, 0},
+        {0, {1, 2, 4, 0}, 0, {{2, 2}, {0, 0}}, 1},
+        {0, {1, 2, 4, 0}, 1, {{2, 2}, {4, 1}, {0, 0}}, 0},
+        {0, {1, -2, 3, 5, -6, 7, 0}, 1, {{3, 2}, {5, 1}, {7, 1}, {0, 0}}, 0},
+    };
+    UNITTEST_PROLOG;
+
+    FOREACHDATA {
+        amqp_delivery_tracker_t tr;
+        uint64_t tag;
+        unsigned j;
+
+        amqp_delivery_tracker_init(&tr);
+        for (tag = 1; tag <= NDELIVERIES; ++tag) {
+            amqp_delivery_tracker_add(&tr, tag, 0);
+        }
+        nacks = 0;
+        for (j = 0; CDATA.completed[j] != 0; ++j) {
+            int res;
+
+            if (CDATA.completed[j] > 0) {
+                res = amqp_delivery_tracker_ack(&tr, CDATA.completed[j], 0);
+            } else {
+                res = amqp_delivery_tracker_settle(&tr, -CDATA.completed[j]);
+            }
+            if (res != 0) {
+                FAIL("test_batch");
+            }
+        }
+        (void)amqp_delivery_tracker_collect(&tr, CDATA.flush, ack_cb, NULL);
+        check_acks("test_batch", CDATA.expected);
+        if (tr.nready != CDATA.nready) {
+            TRACE("nready %zd expected %zd", tr.nready, CDATA.nready);
+            FAIL("test_batch nready");
+        }
+        amqp_delivery_tracker_fini(&tr);
+    }
+}
+
+
+/*
+ * Tags skipped by the broker, stale ones, and no-ack deliveries are all
+ * settled, a multiple ack runs over them.
+ */
+static void
+test_skipped(void)
+{
+    amqp_delivery_tracker_t tr;
+    ack_t expected0[] = {{5, 3}, {0, 0}};
+    ack_t expected1[] = {{8, 1}, {0, 0}};
+
+    amqp_delivery_tracker_init(&tr);
+    amqp_delivery_tracker_add(&tr, 1, 0);
+    amqp_delivery_tracker_add(&tr, 2, 0);
+    amqp_delivery_tracker_add(&tr, 5, 0);
+    /* behind the sequence, ignored */
+    amqp_delivery_tracker_add(&tr, 4, 0);
+    if (amqp_delivery_tracker_unsettled(&tr, 3) ||
+        amqp_delivery_tracker_unsettled(&tr, 4) ||
+        amqp_delivery_tracker_ack(&tr, 4, 0) == 0) {
+        FAIL("test_skipped unsettled");
+    }
+    nacks = 0;
+    if (amqp_delivery_tracker_ack(&tr, 5, 0) != 0 ||
+        amqp_delivery_tracker_ack(&tr, 1, 0) != 0 ||
+        amqp_delivery_tracker_ack(&tr, 2, 0) != 0) {
+        FAIL("test_skipped ack");
+    }
+    (void)amqp_delivery_tracker_collect(&tr, 0, ack_cb, NULL);
+    check_acks("test_skipped", expected0);
+
+    amqp_delivery_tracker_add(&tr, 6, 1);
+    amqp_delivery_tracker_add(&tr, 8, 0);
+    nacks = 0;
+    if (amqp_delivery_tracker_ack(&tr, 6, 0) == 0 ||
+        amqp_delivery_tracker_ack(&tr, 8, 0) != 0) {
+        FAIL("test_skipped noack");
+    }
+    (void)amqp_delivery_tracker_collect(&tr, 0, ack_cb, NULL);
+    check_acks("test_skipped", expected1);
+    amqp_delivery_tracker_fini(&tr);
+}
+
+
+/*
+ * No-ack deliveries never pile up: the ring keeps its size over many
+ * times as many of them, with no collect in between.
+ */
+static void
+test_noack(void)
+{
+    amqp_delivery_tracker_t tr;
+    uint64_t tag;
+    size_t sz;
+
+    amqp_delivery_tracker_init(&tr);
+    sz = tr.sz;
+    for (tag = 1; tag <= sz * 64; ++tag) {
+        amqp_delivery_tracker_add(&tr, tag, 1);
+    }
+    if (tr.sz != sz || tr.base != tr.next) {
+        FAIL("test_noack");
+    }
+    amqp_delivery_tracker_fini(&tr);
+}
+
+
+/*
+ * The ring grows while wrapped around, and by more than double for a
+ * far ahead tag, keeping the state of the deliveries in it.
+ */
+static void
+test_grow(void)
+{
+    amqp_delivery_tracker_t tr;
+    uint64_t tag, half, last;
+    size_t sz;
+    ack_t expected0[] = {{0, 0}, {0, 0}};
+    ack_t expected1[] = {{0, 0}, {0, 0}};
+
+    amqp_delivery_tracker_init(&tr);
+    sz = tr.sz;
+    half = sz / 2;
+    last = sz * 5;
+    for (tag = 1; tag <= sz; ++tag) {
+        amqp_delivery_tracker_add(&tr, tag, 0);
+    }
+    for (tag = 1; tag <= half; ++tag) {
+        (void)amqp_delivery_tracker_ack(&tr, tag, 0);
+    }
+    nacks = 0;
+    (void)amqp_delivery_tracker_collect(&tr, 0, ack_cb, NULL);
+    expected0[0].tag = half;
+    expected0[0].n = half;
+    check_acks("test_grow", expected0);
+
+    /* wrapped, then past twice the size */
+    for (tag = sz + 1; tag <= sz + half; ++tag) {
+        amqp_delivery_tracker_add(&tr, tag, 0);
+    }
+    amqp_delivery_tracker_add(&tr, last, 0);
+    if (tr.sz < 4 * sz) {
+        FAIL("test_grow sz");
+    }
+    for (tag = half + 1; tag <= sz + half; ++tag) {
+        if (!amqp_delivery_tracker_unsettled(&tr, tag)) {
+            TRACE("tag %"PRIu64, tag);
+            FAIL("test_grow unsettled");
+        }
+    }
+    for (tag = last; tag > half; --tag) {
+        (void)amqp_delivery_tracker_ack(&tr, tag, 0);
+    }
+    nacks = 0;
+    (void)amqp_delivery_tracker_collect(&tr, 0, ack_cb, NULL);
+    expected1[0].tag = last;
+    expected1[0].n = sz + 1;
+    check_acks("test_grow", expected1);
+    if (tr.nready != 0 || tr.base != last + 1) {
+        FAIL("test_grow base");
+    }
+    amqp_delivery_tracker_fini(&tr);
+}
+
+
+int
+main(void)
+{
+    test_pool();
+    test_batch();
+    test_skipped();
+    test_noack();
+    test_grow();
+    return 0;
+}
@@ -0,0 +1,228 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef DO_MEMDEBUG
+#include <mncommon/memdebug.h>
+MEMDEBUG_DECLARE(mnamqp_testheader);
+#endif
+
+#include <mncommon/bytestream.h>
+#include <mncommon/dumpm.h>
+
+#include <mnamqp_private.h>
+
+#include "diag.h"
+
+#include "unittest.h"
+
+#ifndef NDEBUG
+const char *_malloc_options = "AJ";
+#endif
+
+/*
+ * Content header builder, no broker needed: the merged properties are
+ * byte for byte what amqp_header_enc_props() makes of a header with the
+ * same properties, per-message ones taking the place of static ones.
+ */
+
+typedef struct _props {
+    const char *content_type;
+    uint8_t delivery_mode;
+    /* a headers table entry */
+    const char *hkey;
+    const char *correlation_id;
+    const char *reply_to;
+    const char *expiration;
+    const char *message_id;
+    uint64_t timestamp;
+    const char *type;
+    const char *app_id;
+} props_t;
+
+
+#define HEADER_SETB(h, p, n)                                   \
+if ((p)->n != NULL) {                                          \
+    mnbytes_t *b;                                              \
+    b = bytes_new_from_str((p)->n);                            \
+    AMQP_HEADER_SET_REF(n)(h, b);                              \
+}                                                              \
+
+
+static amqp_header_t *
+header_new(const props_t *p)
+{
+    amqp_header_t *h;
+
+    h = amqp_header_new();
+    HEADER_SETB(h, p, content_type);
+    if (p->delivery_mode != 0) {
+        amqp_header_set_delivery_mode(h, p->delivery_mode);
+    }
+    if (p->hkey != NULL) {
+        AMQP_HEADER_SETH_REF(i32)(h, p->hkey, 42);
+    }
+    HEADER_SETB(h, p, correlation_id);
+    HEADER_SETB(h, p, reply_to);
+    HEADER_SETB(h, p, expiration);
+    HEADER_SETB(h, p, message_id);
+    if (p->timestamp != 0) {
+        amqp_header_set_timestamp(h, p->timestamp);
+    }
+    HEADER_SETB(h, p, type);
+    HEADER_SETB(h, p, app_id);
+    return h;
+}
+
+
+#define BUILDER_SETB(hb, p, n)                                 \
+if ((p)->n != NULL) {                                          \
+    mnbytes_t *b;                                              \
+    b = bytes_new_from_str((p)->n);                            \
+    BYTES_INCREF(b);                                           \
+    amqp_header_builder_set_##n(hb, b);                        \
+    BYTES_DECREF(&b);                                          \
+}                                                              \
+
+
+/*
+ * the per-message properties of p
+ */
+static void
+builder_set(amqp_header_builder_t *hb, const props_t *p)
+{
+    BUILDER_SETB(hb, p, correlation_id);
+    BUILDER_SETB(hb, p, reply_to);
+    BUILDER_SETB(hb, p, expiration);
+    BUILDER_SETB(hb, p, message_id);
+    if (p->timestamp != 0) {
+        amqp_header_builder_set_timestamp(hb, p->timestamp);
+    }
+    BUILDER_SETB(hb, p, type);
+}
+
+
+#define MERGE(m, p, n)                                         \
+if ((p)->n) {                                                  \
+    (m)->n = (p)->n;                                           \
+}                                                              \
+
+
+static void
+check_builder(const char *name, amqp_header_builder_t *hb, const props_t *p)
+{
+    amqp_header_t *h;
+    mnbytestream_t bs;
+    char *buf;
+    size_t sz;
+
+    h = header_new(p);
+    bytestream_init(&bs, 256);
+    amqp_header_enc_props(h, &bs);
+
+    sz = amqp_header_builder_size(hb);
+    if ((buf = malloc(sz)) == NULL) {
+        FAIL("malloc");
+    }
+    amqp_header_builder_copy(hb, buf);
+    if (sz != (size_t)SEOD(&bs) || memcmp(buf, SDATA(&bs, 0), sz) != 0) {
+        TRACE("%s: builder", name);
+        D8(buf, sz);
+        TRACE("%s: expected", name);
+        D8(SDATA(&bs, 0), SEOD(&bs));
+        FAIL(name);
+    }
+
+    free(buf);
+    bytestream_fini(&bs);
+    amqp_header_destroy(&h);
+}
+
+
+static void
+test_builder(void)
+{
+    struct {
+        long rnd;
+        int nostatics;
+        props_t statics;
+        props_t msg;
+    } data[] = {
+        {0, 1, {0}, {0}},
+        {0, 0, {0}, {0}},
+        {0, 1, {0}, {.correlation_id = "c1", .timestamp = 1234567890}},
+        {0, 0, {.content_type = "application/json",
+                .delivery_mode = 2,
+                .app_id = "testheader"},
+               {0}},
+        {0, 0, {.content_type = "application/json",
+                .delivery_mode = 2,
+                .app_id = "testheader"},
+               {.correlation_id = "c1",
+                .reply_to = "amq.rabbitmq.reply-to",
+                .expiration = "60000",
+                .message_id = "m1",
+                .timestamp = 1234567890,
+                .type = "event"}},
+        /* per-message values take the place of static ones */
+        {0, 0, {.correlation_id = "static",
+                .type = "static",
+                .app_id = "testheader"},
+               {.correlation_id = "c1", .type = "event"}},
+        {0, 0, {.content_type = "text/plain",
+                .hkey = "x-retries",
+                .message_id = "static"},
+               {.reply_to = "replies", .message_id = "m1"}},
+    };
+    UNITTEST_PROLOG;
+
+    FOREACHDATA {
+        amqp_header_builder_t hb;
+        amqp_header_t *statics;
+        props_t merged, stale;
+
+        statics = header_new(&CDATA.statics);
+        amqp_header_builder_init(&hb, CDATA.nostatics ? NULL : statics);
+        amqp_header_destroy(&statics);
+
+        /* set anew, the last value is the one encoded */
+        stale = CDATA.msg;
+        if (stale.correlation_id != NULL) {
+            stale.correlation_id = "stale";
+        }
+        if (stale.message_id != NULL) {
+            stale.message_id = "stale-message-id";
+        }
+        stale.timestamp = stale.timestamp != 0 ? 1 : 0;
+        builder_set(&hb, &stale);
+        builder_set(&hb, &CDATA.msg);
+
+        merged = CDATA.statics;
+        MERGE(&merged, &CDATA.msg, correlation_id);
+        MERGE(&merged, &CDATA.msg, reply_to);
+        MERGE(&merged, &CDATA.msg, expiration);
+        MERGE(&merged, &CDATA.msg, message_id);
+        MERGE(&merged, &CDATA.msg, timestamp);
+        MERGE(&merged, &CDATA.msg, type);
+        check_builder("test_builder", &hb, &merged);
+
+        /* reset leaves the static properties alone */
+        amqp_header_builder_reset(&hb);
+        check_builder("test_builder reset", &hb, &CDATA.statics);
+        builder_set(&hb, &CDATA.msg);
+        check_builder("test_builder reused", &hb, &merged);
+
+        amqp_header_builder_fini(&hb);
+    }
+}
+
+
+int
+main(void)
+{
+    mnamqp_init();
+    test_builder();
+    mnamqp_fini();
+    return 0;
+}
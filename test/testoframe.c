@@ -0,0 +1,247 @@
+#include <assert.h>
+#include <string.h>
+
+#ifdef DO_MEMDEBUG
+#include <mncommon/memdebug.h>
+MEMDEBUG_DECLARE(mnamqp_testoframe);
+#endif
+
+#include <mncommon/dumpm.h>
+
+#include <mnamqp_private.h>
+
+#include "diag.h"
+
+#include "unittest.h"
+
+#ifndef NDEBUG
+const char *_malloc_options = "AJ";
+#endif
+
+/*
+ * Outbound frame scheduling, no broker needed: the order queued frames
+ * are sent in.  Sent frames are spelled out as the channel number for a
+ * basic.publish, a dot for its header and body frames, H for a heartbeat,
+ * and a capital letter for another method, A on channel 0.
+ */
+
+#define NCHANNELS 3
+#define NFRAMES 64
+#define NSETS 4
+#define BODY_SZ AMQP_SEND_QUANTUM
+
+static amqp_conn_t conn;
+static amqp_channel_t channels[NCHANNELS];
+static amqp_frame_t frames[NFRAMES];
+static size_t nframes;
+
+static amqp_method_info_t ack_info = {.mid = AMQP_BASIC_ACK};
+static amqp_meth_params_t ack_params = {.mi = &ack_info};
+
+
+static void
+setup(void)
+{
+    unsigned i;
+
+    memset(&conn, 0, sizeof(conn));
+    STQUEUE_INIT(&conn.ocontrol);
+    DTQUEUE_INIT(&conn.ochannels);
+    for (i = 0; i < countof(channels); ++i) {
+        amqp_channel_t *chan;
+
+        chan = &channels[i];
+        memset(chan, 0, sizeof(*chan));
+        chan->conn = &conn;
+        chan->id = i;
+        STQUEUE_INIT(&chan->oframes);
+        STQUEUE_INIT(&chan->oparked);
+        DTQUEUE_ENTRY_INIT(olink, chan);
+        chan->oweight = 1;
+    }
+    nframes = 0;
+}
+
+
+static amqp_frame_t *
+frame(unsigned id, uint8_t type, uint32_t sz)
+{
+    amqp_frame_t *fr;
+
+    if (nframes >= countof(frames)) {
+        FAIL("queue");
+    }
+    fr = &frames[nframes++];
+    memset(fr, 0, sizeof(*fr));
+    STQUEUE_ENTRY_INIT(link, fr);
+    fr->chan = id;
+    fr->type = type;
+    fr->sz = sz;
+    if (type == AMQP_FMETHOD) {
+        fr->payload.params = &ack_params;
+    }
+    return fr;
+}
+
+
+static void
+queue(unsigned id, uint8_t type, uint32_t sz)
+{
+    amqp_conn_queue_oframe(&conn, &channels[id], frame(id, type, sz));
+}
+
+
+static void
+queue_stream(unsigned id, uint32_t sz)
+{
+    amqp_conn_queue_stream_oframe(&conn,
+                                  &channels[id],
+                                  frame(id, AMQP_FBODY, sz));
+}
+
+
+static void
+queue_set(unsigned id, unsigned nbodies)
+{
+    queue(id, AMQP_FMETHODRAW, 20);
+    queue(id, AMQP_FHEADER, 30);
+    while (nbodies-- > 0) {
+        queue(id, AMQP_FBODY, BODY_SZ);
+    }
+}
+
+
+static void
+check_sent(const char *name, const char *expected)
+{
+    char sent[NFRAMES + 1];
+    amqp_frame_t *fr;
+    size_t i;
+
+    for (i = 0; (fr = amqp_conn_next_oframe(&conn)) != NULL; ++i) {
+        if (i >= countof(sent) - 1) {
+            FAIL(name);
+        }
+        switch (fr->type) {
+        case AMQP_FMETHODRAW:
+            sent[i] = '0' + fr->chan;
+            break;
+
+        case AMQP_FMETHOD:
+            sent[i] = 'A' + fr->chan;
+            break;
+
+        case AMQP_FHEARTBEAT:
+            sent[i] = 'H';
+            break;
+
+        default:
+            sent[i] = '.';
+        }
+    }
+    sent[i] = '\0';
+    if (strcmp(sent, expected) != 0) {
+        TRACE("%s: sent %s expected %s", name, sent, expected);
+        FAIL(name);
+    }
+    if (conn.oframes != 0 ||
+        conn.oframes_bytes != 0 ||
+        !DTQUEUE_EMPTY(&conn.ochannels)) {
+        FAIL(name);
+    }
+}
+
+
+/*
+ * Methods and heartbeats overtake the content of other channels, never
+ * that of their own.
+ */
+static void
+test_control(void)
+{
+    setup();
+    queue_set(1, 1);
+    queue(1, AMQP_FMETHOD, 12);
+    queue(0, AMQP_FHEARTBEAT, 0);
+    queue(2, AMQP_FMETHOD, 12);
+    check_sent("test_control", "HC1..B");
+    if (conn.stats.ocontrol != 2) {
+        FAIL("test_control ocontrol");
+    }
+}
+
+
+/*
+ * Frames of a channel queued between the header and the last body frame
+ * of a streamed publish go after it, even when its queue has drained in
+ * between, those of other channels do not wait.
+ */
+static void
+test_stream(void)
+{
+    setup();
+    queue(1, AMQP_FMETHODRAW, 20);
+    queue(1, AMQP_FHEADER, 30);
+    amqp_conn_stream_begin(&conn, &channels[1]);
+    queue_stream(1, BODY_SZ);
+    check_sent("test_stream drained", "1..");
+    queue(1, AMQP_FMETHOD, 12);
+    queue_set(1, 1);
+    queue(2, AMQP_FMETHOD, 12);
+    queue_stream(1, BODY_SZ);
+    amqp_conn_stream_end(&conn, &channels[1]);
+    check_sent("test_stream", "C.B1..");
+}
+
+
+/*
+ * Channels take turns by weight, content sets of sets[chan] body frames
+ * each, zero terminated, are never split, and an overdraft is paid off in
+ * later turns.
+ */
+static void
+test_turns(void)
+{
+    struct {
+        long rnd;
+        unsigned weights[2];
+        unsigned sets[2][NSETS + 1];
+        const char *expected;
+    } data[] = {
+        {0, {1, 1}, {{1, 1, 1, 0}, {1, 1, 1, 0}}, "1..2..1..2..1..2.."},
+        /* alone, no overdraft to carry */
+        {0, {1, 1}, {{1, 1, 0}, {0}}, "1..1.."},
+        {0, {3, 1}, {{1, 1, 1, 1, 0}, {1, 1, 0}}, "1..1..1..2..1..2.."},
+        {0, {1, 2}, {{1, 1, 1, 0}, {1, 1, 1, 0}}, "1..2..2..1..2..1.."},
+        {0, {1, 1}, {{4, 1, 0}, {1, 1, 0}}, "1.....2..2..1.."},
+    };
+    UNITTEST_PROLOG;
+
+    FOREACHDATA {
+        unsigned j, k;
+
+        setup();
+        for (j = 0; j < 2; ++j) {
+            channels[j + 1].oweight = CDATA.weights[j];
+        }
+        for (j = 0; j < 2; ++j) {
+            for (k = 0; CDATA.sets[j][k] != 0; ++k) {
+                queue_set(j + 1, CDATA.sets[j][k]);
+            }
+        }
+        check_sent("test_turns", CDATA.expected);
+    }
+}
+
+
+int
+main(void)
+{
+    test_control();
+    test_stream();
+    test_turns();
+    if (amqp_conn_next_oframe(&conn) != NULL) {
+        FAIL("main");
+    }
+    return 0;
+}
@@ -0,0 +1,258 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef DO_MEMDEBUG
+#include <mncommon/memdebug.h>
+MEMDEBUG_DECLARE(mnamqp_testslab);
+#endif
+
+#include <mncommon/dumpm.h>
+#include <mncommon/util.h>
+
+#include <mnamqp_private.h>
+
+#include "diag.h"
+
+#include "unittest.h"
+#include "mybench.h"
+
+#ifndef NDEBUG
+const char *_malloc_options = "AJ";
+#endif
+
+/*
+ * Body buffer allocator, no broker needed: size classes and reuse, then a
+ * microbenchmark of the system malloc against the slab in front of it,
+ * over a window of buffers in flight with sizes clustered the way bodies
+ * are.  For jemalloc, run again with it preloaded, see testslab-run in
+ * Makefile.am.
+ */
+
+#define NITER 2000000
+#define NINFLIGHT 256
+#define FRAME_MAX 131072
+
+static size_t sizes[] = {
+    FRAME_MAX - 8,
+    FRAME_MAX - 8,
+    FRAME_MAX - 8,
+    200,
+    1500,
+    4096,
+    16000,
+    FRAME_MAX - 8,
+};
+
+static struct {
+    void *buf;
+    size_t sz;
+} inflight[NINFLIGHT];
+
+static amqp_slab_t *slab;
+
+/* size of the last block taken from the backing allocator */
+static size_t lastsz;
+static size_t nblocks;
+
+
+static void *
+block_alloc(size_t sz)
+{
+    lastsz = sz;
+    ++nblocks;
+    return malloc(sz);
+}
+
+
+static void
+block_free(void *o)
+{
+    if (nblocks == 0) {
+        FAIL("block_free");
+    }
+    --nblocks;
+    free(o);
+}
+
+
+/*
+ * Buffers are taken from the backing allocator rounded up to their class,
+ * and at their own size above the largest one.
+ */
+static void
+test_class(void)
+{
+    struct {
+        long rnd;
+        size_t max;
+        size_t sz;
+        size_t expected;
+    } data[] = {
+        {0, FRAME_MAX, 1, 64},
+        {0, FRAME_MAX, 64, 64},
+        {0, FRAME_MAX, 65, 128},
+        {0, FRAME_MAX, 1500, 2048},
+        {0, FRAME_MAX, 4096, 4096},
+        {0, FRAME_MAX, 4097, 8192},
+        {0, FRAME_MAX, FRAME_MAX - 8, FRAME_MAX},
+        {0, FRAME_MAX, FRAME_MAX, FRAME_MAX},
+        {0, FRAME_MAX, FRAME_MAX + 1, FRAME_MAX + 1},
+        /* the largest class is max rounded up */
+        {0, FRAME_MAX - 8, FRAME_MAX, FRAME_MAX},
+        {0, 100, 128, 128},
+        {0, 100, 129, 129},
+    };
+    UNITTEST_PROLOG;
+
+    FOREACHDATA {
+        void *o;
+
+        slab = amqp_slab_new(CDATA.max, FRAME_MAX, block_alloc, block_free);
+        if ((o = amqp_slab_alloc(slab, CDATA.sz)) == NULL) {
+            FAIL("amqp_slab_alloc");
+        }
+        if (lastsz != CDATA.expected) {
+            TRACE("max %zd sz %zd: %zd, expected %zd",
+                  CDATA.max,
+                  CDATA.sz,
+                  lastsz,
+                  CDATA.expected);
+            FAIL("test_class");
+        }
+        amqp_slab_free(slab, o, CDATA.sz);
+        amqp_slab_destroy(&slab);
+        if (nblocks != 0) {
+            FAIL("test_class nblocks");
+        }
+    }
+}
+
+
+/*
+ * Freed buffers are handed out again for any size of their class, and
+ * cached up to the high-water mark only.
+ */
+static void
+test_reuse(void)
+{
+    void *a, *b, *c;
+
+    slab = amqp_slab_new(FRAME_MAX, 256, block_alloc, block_free);
+
+    a = amqp_slab_alloc(slab, 100);
+    amqp_slab_free(slab, a, 100);
+    if ((b = amqp_slab_alloc(slab, 120)) != a ||
+        slab->stats.hits != 1 ||
+        slab->stats.cached != 0) {
+        FAIL("test_reuse same class");
+    }
+    amqp_slab_free(slab, b, 120);
+    if ((c = amqp_slab_alloc(slab, 200)) == a || slab->stats.hits != 1) {
+        FAIL("test_reuse other class");
+    }
+    if (slab->stats.cached != 128) {
+        FAIL("test_reuse cached");
+    }
+
+    /* 128 + 256 is over the mark */
+    amqp_slab_free(slab, c, 200);
+    if (slab->stats.cached != 128 ||
+        slab->stats.trimmed != 1 ||
+        nblocks != 1) {
+        FAIL("test_reuse hwm");
+    }
+
+    /* bypassing buffers are never cached */
+    a = amqp_slab_alloc(slab, FRAME_MAX + 1);
+    amqp_slab_free(slab, a, FRAME_MAX + 1);
+    if (slab->stats.cached != 128 || nblocks != 1) {
+        FAIL("test_reuse bypass");
+    }
+
+    amqp_slab_trim(slab, 0);
+    if (slab->stats.cached != 0 || nblocks != 0) {
+        FAIL("test_reuse trim");
+    }
+    amqp_slab_destroy(&slab);
+}
+
+
+static void *
+slab_alloc(size_t sz)
+{
+    return amqp_slab_alloc(slab, sz);
+}
+
+
+static void
+slab_free(void *o, size_t sz)
+{
+    amqp_slab_free(slab, o, sz);
+}
+
+
+static void
+malloc_free(void *o, UNUSED size_t sz)
+{
+    free(o);
+}
+
+
+static void
+bench(const char *name, void *(*alloc)(size_t), void (*free_)(void *, size_t))
+{
+    uint64_t t0, t1;
+    int i;
+
+    memset(inflight, 0, sizeof(inflight));
+    t0 = mybench_nsec();
+    for (i = 0; i < NITER; ++i) {
+        unsigned j;
+
+        j = i % NINFLIGHT;
+        if (inflight[j].buf != NULL) {
+            free_(inflight[j].buf, inflight[j].sz);
+        }
+        inflight[j].sz = sizes[i % countof(sizes)];
+        if ((inflight[j].buf = alloc(inflight[j].sz)) == NULL) {
+            FAIL("alloc");
+        }
+        /* the receiving thread writes the payload in */
+        memset(inflight[j].buf, 'x', MIN(inflight[j].sz, 256));
+    }
+    for (i = 0; i < NINFLIGHT; ++i) {
+        if (inflight[i].buf != NULL) {
+            free_(inflight[i].buf, inflight[i].sz);
+        }
+    }
+    t1 = mybench_nsec();
+
+    TRACE("%-8s %7.2f ns per alloc/free", name, mybench_per(t0, t1, NITER));
+}
+
+
+int
+main(void)
+{
+    mnamqp_init();
+
+    test_class();
+    test_reuse();
+
+    bench("malloc", malloc, malloc_free);
+
+    slab = amqp_slab_new(FRAME_MAX, 64 * FRAME_MAX, malloc, free);
+    bench("slab", slab_alloc, slab_free);
+    TRACE("slab hits %"PRIu64" misses %"PRIu64" trimmed %"PRIu64
+          " cached peak %zd",
+          slab->stats.hits,
+          slab->stats.misses,
+          slab->stats.trimmed,
+          slab->stats.cached_peak);
+    amqp_slab_destroy(&slab);
+
+    mnamqp_fini();
+    return 0;
+}